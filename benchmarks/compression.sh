@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+# Hit latency and database size with and without output compression.
+#
+#   usage: benchmarks/compression.sh [BUILD_DIR] [NUM_COMMANDS] [NUM_HITS]
+#
+# Caches NUM_COMMANDS commands whose --help prints ~150 KB of help text (each
+# slightly different, so they aren't deduplicated), once with
+# CACHEDASHH_COMPRESS=0 and once with the default, then reports the size of
+# each database and the mean wall time of NUM_HITS cache hits piped into
+# another process.
+set -e
+
+BUILD_DIR=$(realpath "${1:-build}")
+NUM_COMMANDS=${2:-50}
+NUM_HITS=${3:-200}
+export PATH="$BUILD_DIR:$PATH"
+export CACHEDASHH_STABLEPATH="/dev:/sys:/usr/:/etc/:/lib/:/lib64/"
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# help text shaped like a big multi-command tool's
+for i in $(seq 800); do
+    echo "  subcommand-$i [--flag-$i VALUE] [--other-option-$i]"
+    echo "        Does thing number $i. See 'tool help subcommand-$i' for the full"
+    echo "        list of options and some examples of how to use them together."
+done > "$WORKDIR/help.txt"
+
+now_ns() { date +%s%N; }
+
+run() {
+    local label=$1 compress=$2
+    export CACHEDASHH_DB="$WORKDIR/$label.db"
+    for i in $(seq "$NUM_COMMANDS"); do
+        CACHEDASHH_COMPRESS=$compress cache-dash-h bash -c "cat '$WORKDIR/help.txt'; echo \$0" "$i" --help \
+            > /dev/null
+    done
+
+    local start end
+    start=$(now_ns)
+    for i in $(seq "$NUM_HITS"); do
+        cache-dash-h bash -c "cat '$WORKDIR/help.txt'; echo \$0" "$((i % NUM_COMMANDS + 1))" --help | cat \
+            > /dev/null
+    done
+    end=$(now_ns)
+
+    printf "%-12s db size: %8d KB   hit: %6.3f ms\n" "$label" \
+        $(($(stat -c %s "$CACHEDASHH_DB") / 1024)) \
+        "$(awk "BEGIN { print ($end - $start) / $NUM_HITS / 1e6 }")"
+}
+
+echo "help text: $(($(stat -c %s "$WORKDIR/help.txt") / 1024)) KB, $NUM_COMMANDS commands, $NUM_HITS hits"
+run uncompressed 0
+run compressed 1
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Startup latency of a call that doesn't ask for help, which cache-dash-h
+# just passes through to the command.
+#
+#   usage: benchmarks/startup.sh [BUILD_DIR] [ITERATIONS] [COMMAND...]
+#
+# Runs COMMAND (default: true) ITERATIONS times directly, then as many times
+# through cache-dash-h, and reports the mean time per call of each and the
+# overhead of the wrapper.
+set -e
+
+BUILD_DIR=$(realpath "${1:-build}")
+ITERATIONS=${2:-1000}
+shift 2 || shift $#
+COMMAND=("${@:-true}")
+export CACHEDASHH_DB=$(mktemp -u)
+
+# mean microseconds per call of "$@"
+per_call() {
+    local start end
+    start=${EPOCHREALTIME/./}
+    for ((i = 0; i < ITERATIONS; i++)); do
+        "$@" > /dev/null
+    done
+    end=${EPOCHREALTIME/./}
+    echo $(((end - start) / ITERATIONS))
+}
+
+# resolve it the way exec does, so the direct run doesn't pay for a
+# builtin's shortcut
+program=$(type -P "${COMMAND[0]}")
+direct=$(per_call "$program" "${COMMAND[@]:1}")
+wrapped=$(per_call "$BUILD_DIR/cache-dash-h" "${COMMAND[@]}")
+
+echo "${COMMAND[*]}: $ITERATIONS calls each"
+printf "direct   %7d us/call\n" "$direct"
+printf "wrapped  %7d us/call\n" "$wrapped"
+printf "overhead %7d us/call\n" $((wrapped - direct))
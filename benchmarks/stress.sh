@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# Latency under concurrent readers and writers sharing one cache.
+#
+#   usage: benchmarks/stress.sh [BUILD_DIR] [READERS] [WRITERS] [ITERATIONS]
+#
+# READERS processes each run ITERATIONS cache hits of one command, while
+# WRITERS processes each run ITERATIONS misses (distinct commands, so every
+# one is traced and inserted). Reports latency percentiles for both, and the
+# number of calls that failed or printed the wrong thing.
+set -e
+
+BUILD_DIR=$(realpath "${1:-build}")
+READERS=${2:-8}
+WRITERS=${3:-4}
+ITERATIONS=${4:-50}
+export PATH="$BUILD_DIR:$PATH"
+export CACHEDASHH_STABLEPATH="/dev:/sys:/usr/:/etc/:/lib/:/lib64/"
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+export CACHEDASHH_DB="$WORKDIR/stress.db"
+
+# one call: its latency in microseconds, or "fail"
+timed() {
+    local expected=$1 start end out
+    shift
+    start=${EPOCHREALTIME/./}
+    if out=$("$@" 2>&1) && [ "$out" == "$expected" ]; then
+        end=${EPOCHREALTIME/./}
+        echo $((end - start))
+    else
+        echo fail
+    fi
+}
+
+reader() {
+    for i in $(seq "$ITERATIONS"); do
+        timed "cached help" cache-dash-h bash -c "echo cached help" --help
+    done > "$WORKDIR/reader.$1"
+}
+
+writer() {
+    for i in $(seq "$ITERATIONS"); do
+        timed "help $1 $i" cache-dash-h bash -c "echo help $1 $i" --help
+    done > "$WORKDIR/writer.$1"
+}
+
+report() {
+    local label=$1 failed
+    shift
+    failed=$(cat "$@" | grep -c fail || true)
+    cat "$@" | grep -v fail | sort -n | awk -v label="$label" -v failed="$failed" '
+        { t[NR] = $1 }
+        END {
+            printf "%-8s %5d calls  p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  max %7.2f ms  failed %d\n",
+                label, NR + failed, t[int(NR * 0.50) + 1] / 1000, t[int(NR * 0.90) + 1] / 1000,
+                t[int(NR * 0.99) + 1] / 1000, t[NR] / 1000, failed
+        }'
+}
+
+cache-dash-h bash -c "echo cached help" --help > /dev/null
+
+pids=()
+for r in $(seq "$READERS"); do
+    reader "$r" &
+    pids+=($!)
+done
+for w in $(seq "$WRITERS"); do
+    writer "$w" &
+    pids+=($!)
+done
+wait "${pids[@]}"
+
+echo "$READERS readers, $WRITERS writers, $ITERATIONS calls each"
+report readers "$WORKDIR"/reader.*
+report writers "$WORKDIR"/writer.*
@@ -0,0 +1,54 @@
+#include "access_log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cache_dash_h {
+
+struct access_record {
+    int64_t cmdline_id;
+    int64_t time;
+};
+
+off_t log_access(const std::string& db_path, int64_t cmdline_id) {
+    int fd = open((db_path + ".access").c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    // one write of a few bytes to an O_APPEND file never interleaves
+    // with another's
+    access_record record{cmdline_id, static_cast<int64_t>(std::time(nullptr))};
+    off_t size = -1;
+    if (write(fd, &record, sizeof(record)) == sizeof(record))
+        size = lseek(fd, 0, SEEK_CUR);
+    close(fd);
+    return size;
+}
+
+std::unordered_map<int64_t, int64_t> take_access_log(const std::string& db_path) {
+    std::unordered_map<int64_t, int64_t> latest;
+    // hits from now on start a new log
+    std::string taken = db_path + ".access." + std::to_string(getpid());
+    if (rename((db_path + ".access").c_str(), taken.c_str()) < 0)
+        return latest;
+    int fd = open(taken.c_str(), O_RDONLY | O_CLOEXEC);
+    unlink(taken.c_str());
+    if (fd < 0)
+        return latest;
+
+    access_record records[4096];
+    ssize_t nread;
+    while ((nread = read(fd, records, sizeof(records))) > 0) {
+        // a torn record at the end is dropped
+        for (size_t i = 0; i < static_cast<size_t>(nread) / sizeof(access_record); i++) {
+            int64_t& time = latest[records[i].cmdline_id];
+            time = std::max(time, records[i].time);
+        }
+    }
+    close(fd);
+    return latest;
+}
+
+}; // namespace cache_dash_h
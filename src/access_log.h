@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace cache_dash_h {
+
+/* CACHE.access, where hits record that they used an entry, instead of each
+   updating cmdline.atime: an append needs no lock, no journal and no fsync,
+   so concurrent hits don't queue up behind each other's write transactions.
+   Whoever next writes to the database anyway (eviction, --gc) folds the log
+   into it, as does a hit that finds it has grown past ACCESS_LOG_MAX_SIZE.
+
+   Access times only order entries for eviction, so the log is allowed to
+   be lossy: a record appended while the log is being taken may be dropped.
+*/
+static const off_t ACCESS_LOG_MAX_SIZE = 1 << 20;
+
+/* Record a hit on the entry *cmdline_id* now. Returns the size of the log
+   after it, or -1 if it can't be written.
+*/
+off_t log_access(const std::string& db_path, int64_t cmdline_id);
+
+// empty the log, returning the time of the latest hit on each entry in it
+std::unordered_map<int64_t, int64_t> take_access_log(const std::string& db_path);
+
+}; // namespace cache_dash_h
@@ -0,0 +1,174 @@
+#include "cachedashh.h"
+#include "codec.h"
+#include "database.h"
+#include "hasher.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+
+using namespace cache_dash_h;
+
+struct cachedashh {
+    std::unique_ptr<Database> db;
+    std::string error;
+};
+
+// argv as the command line tool sees it, with argv[0] found in PATH
+static std::vector<std::string> command_vector(const char* const* argv) {
+    std::vector<std::string> cmd;
+    for (size_t i = 0; argv[i] != NULL; i++)
+        cmd.push_back(argv[i]);
+    if (!cmd.empty()) {
+        std::string program = find_in_path(cmd[0], /*allow_ENOENT=*/true);
+        if (!program.empty())
+            cmd[0] = program;
+    }
+    return cmd;
+}
+
+// a malloc'ed, NUL-terminated copy, for C callers to free()
+static char* copy_out(const std::string& s, size_t* size) {
+    char* copy = static_cast<char*>(malloc(s.size() + 1));
+    if (copy != NULL) {
+        memcpy(copy, s.data(), s.size());
+        copy[s.size()] = '\0';
+    }
+    *size = s.size();
+    return copy;
+}
+
+static bool fill_output(const std::string& stdout_, const std::string& stderr_, int exit_status,
+                        cachedashh_output* out) {
+    out->stdout_data = copy_out(stdout_, &out->stdout_size);
+    out->stderr_data = copy_out(stderr_, &out->stderr_size);
+    out->exit_status = exit_status;
+    if (out->stdout_data == NULL || out->stderr_data == NULL) {
+        cachedashh_free_output(out);
+        return false;
+    }
+    return true;
+}
+
+static int save(cachedashh* cache, const std::vector<std::string>& cmd, int length,
+                const std::tuple<std::string, std::string, int>& output,
+                const std::vector<hashed_file>& deps) {
+    try {
+        auto cmdline_id = cache->db->Insert(cmd, hash_command_line(length, cmd), output, deps);
+        cache->db->UpdateIndex(cmdline_id);
+        return 0;
+    } catch (const std::exception& e) {
+        cache->error = e.what();
+        return -1;
+    }
+}
+
+cachedashh* cachedashh_open(const char* db_path) {
+    auto cache = new cachedashh;
+    try {
+        cache->db.reset(new Database(db_path, false));
+    } catch (const std::exception& e) {
+        delete cache;
+        return NULL;
+    }
+    return cache;
+}
+
+void cachedashh_close(cachedashh* cache) {
+    delete cache;
+}
+
+const char* cachedashh_last_error(const cachedashh* cache) {
+    return cache->error.c_str();
+}
+
+int cachedashh_lookup(cachedashh* cache,
+                      const char* const* argv,
+                      int length,
+                      cachedashh_output* out) {
+    auto cmd = command_vector(argv);
+    if (cmd.empty()) {
+        cache->error = "Empty command";
+        return -1;
+    }
+    index_entry entry;
+    try {
+        if (!cache->db->Lookup(hash_command_line(length, cmd), &entry))
+            return 0;
+    } catch (const std::exception& e) {
+        cache->error = e.what();
+        return -1;
+    }
+    std::string outputs[2];
+    for (int i = 0; i < 2; i++) {
+        if (!decode_output(entry.codecs[i], entry.outputs[i].data(), entry.outputs[i].size(),
+                           &outputs[i])) {
+            // written by a build with a codec this one lacks
+            return 0;
+        }
+    }
+    if (!fill_output(outputs[0], outputs[1], entry.exit_status, out)) {
+        cache->error = strerror(ENOMEM);
+        return -1;
+    }
+    return 1;
+}
+
+int cachedashh_record(cachedashh* cache,
+                      const char* const* argv,
+                      int length,
+                      const cachedashh_output* output,
+                      const char* const* deps) {
+    auto cmd = command_vector(argv);
+    if (cmd.empty()) {
+        cache->error = "Empty command";
+        return -1;
+    }
+    try {
+        dependency_hasher hasher(cache->db->Memo());
+        for (size_t i = 0; deps[i] != NULL; i++)
+            hasher.add(deps[i]);
+        auto hashed = hasher.finish();
+        auto tuple = std::make_tuple(std::string(output->stdout_data, output->stdout_size),
+                                     std::string(output->stderr_data, output->stderr_size),
+                                     output->exit_status);
+        return save(cache, cmd, length, tuple, hashed);
+    } catch (const std::exception& e) {
+        cache->error = e.what();
+        return -1;
+    }
+}
+
+int cachedashh_trace_and_record(cachedashh* cache,
+                                const char* const* argv,
+                                int length,
+                                cachedashh_output* out) {
+    auto cmd = command_vector(argv);
+    if (cmd.empty()) {
+        cache->error = "Empty command";
+        return -1;
+    }
+    std::vector<hashed_file> deps;
+    std::tuple<std::string, std::string, int> output;
+    try {
+        output = trace_command(cmd, "ptrace", cache->db->Memo(), false, &deps);
+    } catch (const std::exception& e) {
+        cache->error = e.what();
+        return -1;
+    }
+    if (!fill_output(std::get<0>(output), std::get<1>(output), std::get<2>(output), out)) {
+        cache->error = strerror(ENOMEM);
+        return -1;
+    }
+    return save(cache, cmd, length, output, deps);
+}
+
+void cachedashh_free_output(cachedashh_output* output) {
+    free(output->stdout_data);
+    free(output->stderr_data);
+    memset(output, 0, sizeof(*output));
+}
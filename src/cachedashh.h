@@ -0,0 +1,78 @@
+#ifndef CACHEDASHH_H
+#define CACHEDASHH_H
+/*
+ * libcachedashh: the cache behind cache-dash-h, for programs that want to
+ * check it in-process rather than fork and exec cache-dash-h itself. Entries
+ * are shared with the command line tool: a command recorded by one is found
+ * by the other, given the same cache file and the same *length* (-n).
+ *
+ * Commands are NULL-terminated argv arrays. argv[0] is looked up in PATH,
+ * as exec would, before the command is hashed. A handle is for one thread
+ * at a time.
+ */
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CACHEDASHH_API __attribute__((visibility("default")))
+
+typedef struct cachedashh cachedashh;
+
+typedef struct cachedashh_output {
+    char* stdout_data;
+    size_t stdout_size;
+    char* stderr_data;
+    size_t stderr_size;
+    int exit_status;
+} cachedashh_output;
+
+/* Open (creating it if need be) the cache at *db_path*. Returns NULL if it
+   can't be opened.
+*/
+CACHEDASHH_API cachedashh* cachedashh_open(const char* db_path);
+CACHEDASHH_API void cachedashh_close(cachedashh* cache);
+
+// what the last call that failed on *cache* failed on
+CACHEDASHH_API const char* cachedashh_last_error(const cachedashh* cache);
+
+/* Look for a valid entry for *argv*, hashing only its first *length*
+   arguments (and any help flags after them) if *length* isn't -1. Returns
+   1 and fills in *out* on a hit, 0 on a miss and -1 on error.
+*/
+CACHEDASHH_API int cachedashh_lookup(cachedashh* cache,
+                                     const char* const* argv,
+                                     int length,
+                                     cachedashh_output* out);
+
+/* Save *output* as what *argv* prints for as long as none of the files in
+   *deps* (NULL-terminated) change. They're hashed now. Returns 0, or -1
+   on error.
+*/
+CACHEDASHH_API int cachedashh_record(cachedashh* cache,
+                                     const char* const* argv,
+                                     int length,
+                                     const cachedashh_output* output,
+                                     const char* const* deps);
+
+/* Run *argv* the way cache-dash-h does on a miss: traced with ptrace,
+   its output passed through to ours as well as filled in *out*, and saved
+   with the files it opened as its dependencies. Returns 0; or -1 if it
+   couldn't be traced, or if it ran (and *out* is filled in) but couldn't be
+   saved. A command that can't be exec'd exits with status 1 and a message
+   on stderr. Only running out of processes or file descriptors exits the
+   calling process.
+*/
+CACHEDASHH_API int cachedashh_trace_and_record(cachedashh* cache,
+                                               const char* const* argv,
+                                               int length,
+                                               cachedashh_output* out);
+
+// free what lookup or trace_and_record filled in, and zero it
+CACHEDASHH_API void cachedashh_free_output(cachedashh_output* output);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,499 @@
+#include "cli.h"
+#include "database.h"
+#include "error_prints.h"
+#include "hasher.h"
+#include "server.h"
+#include "trace.h"
+#include "utils.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern int optind;
+extern char* optarg;
+
+using namespace std;
+using namespace cache_dash_h;
+namespace cache_dash_h {
+
+struct options_t {
+    bool verbose{false};
+    std::string db_path{"/tmp/cache-dash-h.db"};
+    int length{-1};
+    std::string tracer{"ptrace"};
+    bool compress{true};
+    bool gc{false};
+    bool watch{false};
+    bool serve{false};
+    int64_t max_entries{0};
+    int64_t max_size{0};
+    int lock_timeout{120};
+    bool background{false};
+    int64_t stale_max_age{0};
+    std::vector<std::string> cmd;
+};
+
+/* A byte count, with an optional K, M or G suffix (powers of 1024) */
+static bool parse_size(const char* s, int64_t* size) {
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0)
+        return false;
+    switch (*end) {
+    case 'G':
+        n *= 1024;
+        // fall through
+    case 'M':
+        n *= 1024;
+        // fall through
+    case 'K':
+        n *= 1024;
+        end++;
+        break;
+    }
+    *size = n;
+    return *end == '\0';
+}
+
+/* A number of seconds, with an optional s, m, h or d suffix */
+static bool parse_duration(const char* s, int64_t* seconds) {
+    char* end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0)
+        return false;
+    switch (*end) {
+    case 'd':
+        n *= 24;
+        // fall through
+    case 'h':
+        n *= 60;
+        // fall through
+    case 'm':
+        n *= 60;
+        // fall through
+    case 's':
+        end++;
+        break;
+    }
+    *seconds = n;
+    return *end == '\0';
+}
+
+/* Re-run ourselves, as *argv*, detached and at the lowest CPU and I/O
+   priority, with stale results turned off: the re-run traces the command
+   and saves a fresh entry, for the next lookup to find. It takes the
+   single-flight lock like any other run, so stale hits in quick succession
+   start one refresh, and the rest find its result.
+*/
+static void revalidate_in_background(const std::vector<std::string>& argv) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid != 0)
+        return; // failing to refresh just means serving stale again later
+
+    setsid();
+    setpriority(PRIO_PROCESS, 0, 19);
+    // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0); glibc has no wrapper
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13);
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO)
+            close(devnull);
+    }
+    setenv("CACHEDASHH_STALE_MAX_AGE", "0", 1);
+    c_cmdline c_style(argv);
+    execv("/proc/self/exe", c_style.c_argv());
+    _exit(EXIT_FAILURE);
+}
+
+/* Fork, and in the parent exit with *exit_status*, so whoever ran us can
+   carry on while the child saves the result. The child detaches from the
+   session and from our stdio (so a pipe reading our output sees EOF now),
+   and returns true. Returns false, in the original process, if there's no
+   child to hand over to.
+
+   Anything the child hasn't committed when it dies is rolled back, so a
+   half-saved entry is never served. If single-flight locking is on, the
+   child keeps holding the lock, and waiters wait for its result.
+*/
+static bool persist_in_background(int exit_status, bool verbose) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid > 0) {
+        if (verbose) {
+            printf("%s: Saving to cache in the background (pid %d)\n",
+                   program_invocation_short_name, static_cast<int>(pid));
+        }
+        exit(exit_status);
+    }
+
+    setsid();
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO)
+            close(devnull);
+    }
+    return true;
+}
+
+options_t parse_our_cmdline(std::vector<std::string> cmd) {
+
+    auto print_usage_and_die = [&]() {
+        printf(R"(usage: %s [-h] [-v] [-l LENGTH] [-c CACHE] COMMAND [ARGS]
+       %s [-v] [-c CACHE] --gc
+       %s [-v] [-c CACHE] --watch
+       %s [-v] [-c CACHE] --serve
+
+optional arguments:
+    -h, --help          show this help message and exit
+    -n NUM              If supplied, cache the text based on only the
+                        first NUM arguments to the inner command.
+                        (default: uses the entire inner command)
+    -p CACHE --path CACHE
+                        Path to cache. (default: "/tmp/cache-dash-h.db")
+                        If CACHE starts with $ORIGIN0, it will be expanded
+                        to the directory conaining the inner command. If CACHE
+                        startswith $ORIGIN1, it will be expanded to the
+                        directory containing the first argument to the inner
+                        command.
+    -v, --verbose       Verbose mode
+    --gc                Delete cache entries that can't be served any more
+                        and the files and outputs only they used, then
+                        shrink the cache file, and exit.
+    --watch             Keep watching the files cached entries depend on
+                        (with inotify), and tell lookups which entries are
+                        still valid, so a hit needn't check its files. Runs
+                        until killed; one per cache.
+    --serve             Answer lookups from a long-lived process, over the
+                        Unix socket CACHE.sock, so a hit needn't open the
+                        cache itself. Runs until killed; one per cache.
+
+environment:
+    CACHEDASHH_MAX_ENTRIES, CACHEDASHH_MAX_SIZE
+                        Keep at most this many entries, or this many bytes
+                        (with an optional K, M or G suffix), in the cache,
+                        evicting the least recently used ones.
+    CACHEDASHH_LOCK_TIMEOUT
+                        When another process is already running the same
+                        command to cache it, wait up to this many seconds
+                        (default: 120) for its result instead of running it
+                        again. 0 turns this off.
+    CACHEDASHH_TREES    Colon-separated directories (e.g. site-packages) whose
+                        files are checked all at once, by a digest of their
+                        stat metadata, rather than one by one. Touching any
+                        file the command used under one invalidates the entry.
+    CACHEDASHH_BACKGROUND
+                        If set (and not 0), exit as soon as the command
+                        does, and save its result to the cache from a
+                        background process.
+    CACHEDASHH_STALE_MAX_AGE
+                        When the newest entry for the command is out of date
+                        but at most this many seconds old (with an optional
+                        s, m, h or d suffix), print it anyway, and refresh it
+                        for next time by running the command in the
+                        background. 0 (the default) turns this off.
+    CACHEDASHH_TRACER   How to find the files the command opens: "ptrace"
+                        (the default), or "preload", which loads a shim into
+                        the command instead of stopping it at every syscall,
+                        and falls back to ptrace where it can't (static or
+                        setuid programs).
+    CACHEDASHH_COMPRESS If 0, store outputs as they are. Otherwise (and by
+                        default) outputs of 4K or more are stored compressed,
+                        in builds with zlib.
+
+required arguments:
+    COMMAND [ARGS...]
+        Command to run, and arguments to pass to it
+
+example:
+    $ %s python slow-script.py --help
+
+)",
+               program_invocation_short_name, program_invocation_short_name,
+               program_invocation_short_name, program_invocation_short_name,
+               program_invocation_short_name);
+        exit(EXIT_SUCCESS);
+    };
+
+    options_t options;
+    char* envvar = getenv("CACHEDASHH_DB");
+    if (envvar != NULL) {
+        options.db_path = std::string(envvar);
+    }
+    envvar = getenv("CACHEDASHH_TRACER");
+    if (envvar != NULL) {
+        options.tracer = std::string(envvar);
+        if (options.tracer != "ptrace" && options.tracer != "preload") {
+            error_msg_and_die("error: CACHEDASHH_TRACER: invalid choice: '%s' (choose from "
+                              "'ptrace', 'preload')",
+                              envvar);
+        }
+    }
+
+    envvar = getenv("CACHEDASHH_MAX_ENTRIES");
+    if (envvar != NULL && !parse_size(envvar, &options.max_entries)) {
+        error_msg_and_die("error: CACHEDASHH_MAX_ENTRIES: invalid int value: '%s'", envvar);
+    }
+    envvar = getenv("CACHEDASHH_MAX_SIZE");
+    if (envvar != NULL && !parse_size(envvar, &options.max_size)) {
+        error_msg_and_die("error: CACHEDASHH_MAX_SIZE: invalid size: '%s'", envvar);
+    }
+    envvar = getenv("CACHEDASHH_LOCK_TIMEOUT");
+    if (envvar != NULL && (sscanf(envvar, "%d", &options.lock_timeout) != 1 ||
+                           options.lock_timeout < 0)) {
+        error_msg_and_die("error: CACHEDASHH_LOCK_TIMEOUT: invalid int value: '%s'", envvar);
+    }
+    envvar = getenv("CACHEDASHH_BACKGROUND");
+    if (envvar != NULL) {
+        options.background = strcmp(envvar, "0") != 0;
+    }
+    envvar = getenv("CACHEDASHH_STALE_MAX_AGE");
+    if (envvar != NULL && !parse_duration(envvar, &options.stale_max_age)) {
+        error_msg_and_die("error: CACHEDASHH_STALE_MAX_AGE: invalid duration: '%s'", envvar);
+    }
+    envvar = getenv("CACHEDASHH_COMPRESS");
+    if (envvar != NULL) {
+        options.compress = strcmp(envvar, "0") != 0;
+    }
+
+    if (cmd.size() > 1 && cmd[1].find(' ') != std::string::npos) {
+        std::vector<std::string> newcmd{cmd[0]};
+        str::split_whitespace(cmd[1], [&](const std::string& s) { newcmd.push_back(s); });
+        for (size_t i = 2; i < cmd.size(); i++)
+            newcmd.push_back(cmd[i]);
+        cmd = newcmd;
+    }
+    // printf("\n");
+    // for (auto c : cmd) {
+    //     printf("'%s'\n", c.c_str());
+    // }
+    static const char optstring[] = "+hvn:p:";
+    static struct option longopts[] = {{"help", no_argument, 0, 'h'},
+                                       {"num", optional_argument, 0, 'n'},
+                                       {"path", optional_argument, 0, 'p'},
+                                       {"verbose", optional_argument, 0, 'v'},
+                                       {"gc", no_argument, 0, 'g'},
+                                       {"watch", no_argument, 0, 'w'},
+                                       {"serve", no_argument, 0, 's'},
+                                       {0, 0, 0, 0}};
+
+    int lopt_idx = -1;
+    int c;
+
+    c_cmdline c_style(cmd);
+    while ((c = getopt_long(c_style.argc, c_style.c_argv(), optstring, longopts, &lopt_idx)) !=
+           EOF) {
+        switch (c) {
+        case 'h':
+            print_usage_and_die();
+            break;
+        case 'n':
+            if (sscanf(optarg, "%d", &options.length) != 1) {
+                error_msg_and_die("error: argument -l/--length: invalid int value: '%s'", optarg);
+            }
+            break;
+        case 'p':
+            options.db_path = std::string(optarg);
+            break;
+        case 'v':
+            options.verbose = true;
+            break;
+        case 'g':
+            options.gc = true;
+            break;
+        case 'w':
+            options.watch = true;
+            break;
+        case 's':
+            options.serve = true;
+            break;
+        default:
+            print_usage_and_die();
+        }
+    }
+
+    // copy the remaining unprocessed arguments into the options struct
+    // this is the subcommand that we're going to exec.
+    for (size_t i = optind; i < cmd.size(); i++) {
+        options.cmd.push_back(cmd[i]);
+    }
+    if (options.gc || options.watch || options.serve)
+        return options;
+    if (options.cmd.size() == 0)
+        print_usage_and_die();
+
+    // expand first argument
+    options.cmd[0] = find_in_path(options.cmd[0]);
+    if (str::startswith(options.db_path, "$ORIGIN0")) {
+        options.db_path = str::replace(options.db_path, "$ORIGIN0", path::dirname(options.cmd[0]));
+    } else if (str::startswith(options.db_path, "$ORIGIN1") && options.cmd.size() > 1) {
+        options.db_path = str::replace(options.db_path, "$ORIGIN1", path::dirname(options.cmd[1]));
+    }
+
+    return options;
+}
+} // namespace cache_dash_h
+
+int cache_dash_h_main(int argc, char** argv) {
+    std::vector<std::string> cmd;
+    for (int i = 0; i < argc; i++)
+        cmd.push_back(argv[i]);
+
+    auto options = parse_our_cmdline(cmd);
+    if (options.gc) {
+        try {
+            Database db(options.db_path, options.verbose);
+            auto num_deleted = db.CollectGarbage();
+            if (options.verbose) {
+                printf("%s: Deleted %lld entries from '%s'\n", program_invocation_short_name,
+                       static_cast<long long>(num_deleted), options.db_path.c_str());
+            }
+        } catch (const SQLite::Exception& e) {
+            error_msg_and_die("Can't collect garbage in %s: %s", options.db_path.c_str(),
+                              e.what());
+        }
+        exit(EXIT_SUCCESS);
+    }
+    if (options.watch) {
+        try {
+            Database db(options.db_path, options.verbose);
+            run_watcher(db, options.db_path, options.verbose);
+        } catch (const SQLite::Exception& e) {
+            error_msg_and_die("Can't watch %s: %s", options.db_path.c_str(), e.what());
+        }
+        exit(EXIT_FAILURE);
+    }
+    if (options.serve) {
+        try {
+            Database db(options.db_path, options.verbose);
+            run_server(db, options.db_path, options.verbose);
+        } catch (const SQLite::Exception& e) {
+            error_msg_and_die("Can't serve %s: %s", options.db_path.c_str(), e.what());
+        }
+        exit(EXIT_FAILURE);
+    }
+    bool have_dash_h = cmd_has_dash_h(options.cmd);
+
+    if (!have_dash_h) {
+        c_cmdline c_style(options.cmd);
+        execvp(c_style.argv[0], c_style.c_argv());
+        perror_msg_and_die("Can't exec '%s'", c_style.argv[0]);
+    }
+
+    auto open_database = [&]() {
+        Database* db = nullptr;
+        try {
+            db = new Database(options.db_path, options.verbose);
+        } catch (const SQLite::Exception& e) {
+            error_msg_and_die("Can't open cache %s: %s", options.db_path.c_str(), e.what());
+        }
+        db->compress_ = options.compress;
+        db->max_entries_ = options.max_entries;
+        db->max_size_ = options.max_size;
+        db->stale_max_age_ = options.stale_max_age;
+        db->revalidate_ = [&]() { revalidate_in_background(cmd); };
+        return db;
+    };
+    auto cmdhash = hash_command_line(options.length, options.cmd);
+
+    // most hits can be served from the index without opening the database
+    {
+        lookup_index index;
+        if (index.open(options.db_path))
+            index.serve_if_valid(cmdhash, options.verbose);
+    }
+    // and the rest by a --serve process, if there is one
+    print_from_server_if_possible(options.db_path, options.length, options.cmd, options.verbose);
+
+    std::unique_ptr<Database> db(open_database());
+
+    // See if we already have the help text. If so, print it and exit
+    try {
+        db->QueryAndPrintHelpAndExitIfPossible(cmdhash);
+    } catch (const SQLite::Exception& e) {
+        if (options.verbose) {
+            printf("%s: Can't read from cache '%s': %s\n", program_invocation_short_name,
+                   options.db_path.c_str(), e.what());
+        }
+    }
+
+    if (db->is_readonly_) {
+        // if the database is read only and we don't have the cmdline in
+        // the cache then there's no point tracing the process, just run
+        // it.
+        c_cmdline c_style(options.cmd);
+        execvp(c_style.argv[0], c_style.c_argv());
+        perror_msg_and_die("Can't exec '%s'", c_style.argv[0]);
+    }
+
+    // Only one process traces a given command at a time. The rest wait for
+    // it here, then find its result in the cache. If it died, the lock died
+    // with it, and the next in line does the tracing.
+    if (options.lock_timeout > 0) {
+        bool waited;
+        int lock_fd = lock_key(options.db_path + ".lock", cmdhash, options.lock_timeout, &waited);
+        if (waited && lock_fd < 0 && options.verbose) {
+            printf("%s: Gave up waiting for another process to cache '%s'\n",
+                   program_invocation_short_name, options.cmd[0].c_str());
+        } else if (waited && lock_fd >= 0) {
+            try {
+                db->QueryAndPrintHelpAndExitIfPossible(cmdhash);
+            } catch (const SQLite::Exception& e) {
+                // as above: we can still run the command ourselves
+            }
+        }
+    }
+
+    // exec process under tracing, gather -h, and store it
+    std::vector<hashed_file> deps;
+    std::tuple<std::string, std::string, int> out;
+    try {
+        out = trace_command(options.cmd, options.tracer, db->Memo(), options.verbose, &deps);
+    } catch (const std::runtime_error& e) {
+        error_msg_and_die("%s", e.what());
+    }
+
+    if (options.background) {
+        // SQLite connections mustn't be open across a fork, so close ours
+        // and open a new one in whichever process does the saving
+        db.reset();
+        persist_in_background(std::get<2>(out), options.verbose);
+        db.reset(open_database());
+    }
+
+    // the command already ran and its output is out: failing to cache it
+    // (e.g. the cache stayed locked too long) mustn't change our exit status
+    try {
+        auto cmdline_id = db->Insert(options.cmd, cmdhash, out, deps);
+        db->UpdateIndex(cmdline_id);
+        if (options.verbose) {
+            printf("%s: Saved to cache '%s'\n", program_invocation_short_name,
+                   options.db_path.c_str());
+        }
+        db->Evict();
+    } catch (const SQLite::Exception& e) {
+        if (options.verbose) {
+            printf("%s: Can't save to cache '%s': %s\n", program_invocation_short_name,
+                   options.db_path.c_str(), e.what());
+        }
+    }
+    exit(std::get<2>(out));
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+/* Everything `cache-dash-h` does besides exec'ing a command that doesn't
+   ask for help, as a main(). It lives in libcachedashh.so, which the
+   executable loads only when it needs it (see main.cpp).
+*/
+extern "C" __attribute__((visibility("default"))) int cache_dash_h_main(int argc, char** argv);
@@ -0,0 +1,107 @@
+#include "codec.h"
+#include "error_prints.h"
+#include "utils.h"
+
+#ifdef CACHEDASHH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace cache_dash_h {
+
+bool codec_supported(int codec) {
+    switch (codec) {
+    case CODEC_NONE:
+        return true;
+#ifdef CACHEDASHH_HAVE_ZLIB
+    case CODEC_DEFLATE:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+#ifdef CACHEDASHH_HAVE_ZLIB
+static bool deflate_output(const std::string& data, std::string* encoded) {
+    uLongf len = compressBound(data.size());
+    encoded->resize(len);
+    if (compress2(reinterpret_cast<Bytef*>(&(*encoded)[0]), &len,
+                  reinterpret_cast<const Bytef*>(data.data()), data.size(), 1) != Z_OK) {
+        return false;
+    }
+    encoded->resize(len);
+    return true;
+}
+
+/* Inflate *data*, handing each decoded chunk to *sink*. */
+template <typename Sink> static bool inflate_output(const void* data, size_t len, Sink sink) {
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+    stream.avail_in = len;
+
+    // decoded a chunk at a time, so a big help text is never held in memory
+    // twice
+    unsigned char buffer[65536];
+    int ret;
+    do {
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+        sink(buffer, sizeof(buffer) - stream.avail_out);
+    } while (ret == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END;
+}
+#endif
+
+bool decode_output(int codec, const void* data, size_t len, std::string* decoded) {
+    decoded->clear();
+    switch (codec) {
+    case CODEC_NONE:
+        decoded->assign(static_cast<const char*>(data), len);
+        return true;
+#ifdef CACHEDASHH_HAVE_ZLIB
+    case CODEC_DEFLATE:
+        return inflate_output(data, len, [&](const unsigned char* chunk, size_t n) {
+            decoded->append(reinterpret_cast<const char*>(chunk), n);
+        });
+#endif
+    default:
+        return false;
+    }
+}
+
+int encode_output(const std::string& data, std::string* encoded) {
+    if (data.size() < COMPRESS_MIN_SIZE)
+        return CODEC_NONE;
+#ifdef CACHEDASHH_HAVE_ZLIB
+    // only worth it if it saves at least an eighth
+    if (deflate_output(data, encoded) && encoded->size() < data.size() - data.size() / 8)
+        return CODEC_DEFLATE;
+#else
+    (void)encoded;
+#endif
+    return CODEC_NONE;
+}
+
+bool write_decoded_output(int fd, int codec, const void* data, size_t len) {
+    switch (codec) {
+    case CODEC_NONE:
+        write_output(fd, data, len);
+        return true;
+#ifdef CACHEDASHH_HAVE_ZLIB
+    case CODEC_DEFLATE:
+        return inflate_output(data, len, [&](const unsigned char* chunk, size_t n) {
+            write_all(fd, chunk, n);
+        });
+#endif
+    default:
+        return false;
+    }
+}
+
+}; // namespace cache_dash_h
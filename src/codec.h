@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace cache_dash_h {
+
+/* How a captured stdout/stderr blob is stored. The tag is saved next to the
+   blob, so these values are part of the database format: never renumber.
+*/
+enum codec_t : int {
+    CODEC_NONE = 0,
+    CODEC_DEFLATE = 1, // zlib stream, level 1
+};
+
+// outputs smaller than this aren't worth a decompressor on the hit path
+static const size_t COMPRESS_MIN_SIZE = 4096;
+
+bool codec_supported(int codec);
+
+/* Pick a codec for *data* by its size, and encode it into *encoded*.
+   Returns the codec used; for CODEC_NONE *encoded* is left untouched and the
+   caller should store *data* itself.
+*/
+int encode_output(const std::string& data, std::string* encoded);
+
+// Decode a blob stored with *codec* into *decoded*; false if we can't.
+bool decode_output(int codec, const void* data, size_t len, std::string* decoded);
+
+/* Decode a blob stored with *codec* and write it to *fd* as it's decoded.
+   Returns false if the codec is unsupported or the blob is corrupt, in
+   which case part of the output may already have been written.
+*/
+bool write_decoded_output(int fd, int codec, const void* data, size_t len);
+
+}; // namespace cache_dash_h
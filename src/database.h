@@ -1,203 +1,1249 @@
+#include "access_log.h"
+#include "codec.h"
+#include "error_prints.h"
+#include "hasher.h"
+#include "index.h"
 #include "utils.h"
+#include "watch.h"
 #include <SQLiteCpp/SQLiteCpp.h>
+#include <sqlite3.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 namespace cache_dash_h {
 
+/* A recorded dependency of a cached command, as read back from the file
+   table, plus what ValidateDependencies found on disk.
+*/
+struct dependency_t {
+    int64_t file_id{0};
+    size_t path_offset{0}; // into dependency_set::paths
+    // a tree's members, also in dependency_set::paths (see tree_digest)
+    size_t members_offset{0};
+    size_t members_size{0};
+    digest_t hash{};
+    file_fingerprint fingerprint;
+    file_fingerprint current;
+    bool rehashed{false};
+};
+
+/* All the dependencies of one cached command in two flat buffers: the
+   fixed-size records, and the paths back to back, each NUL-terminated.
+*/
+struct dependency_set {
+    std::vector<dependency_t> deps;
+    std::vector<char> paths;
+
+    // keeps the capacity of both buffers
+    void clear() {
+        deps.clear();
+        paths.clear();
+    }
+    const char* path(size_t i) const { return &paths[deps[i].path_offset]; }
+    const char* members(size_t i) const { return &paths[deps[i].members_offset]; }
+};
+
+/* Like SQLite::Transaction, but takes the write lock up front. In WAL mode
+   a deferred transaction that reads before it writes fails with
+   SQLITE_BUSY_SNAPSHOT, without waiting, if another process committed in
+   between; BEGIN IMMEDIATE waits for the lock through the busy handler.
+*/
+struct WriteTransaction {
+    explicit WriteTransaction(SQLite::Database& db) : db_(db) { db_.exec("BEGIN IMMEDIATE;"); }
+    ~WriteTransaction() {
+        if (!committed_) {
+            try {
+                db_.exec("ROLLBACK;");
+            } catch (...) {
+            }
+        }
+    }
+    void commit() {
+        db_.exec("COMMIT;");
+        committed_ = true;
+    }
+
+  private:
+    SQLite::Database& db_;
+    bool committed_{false};
+};
+
 struct Database {
+    // bump this, and add a step to Migrate(), whenever the schema changes
+    static constexpr int SCHEMA_VERSION = 7;
+
     Database(const std::string& path, bool verbose)
         : db_(SQLite::Database(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE))
+        , path_(path)
         , verbose_(verbose) {
 
-        try {
-            // force it to throw an exception if the database is read-only
-            db_.exec("PRAGMA user_version = 0;");
-            is_readonly_ = false;
-        } catch (const SQLite::Exception& e) {
-            if (strcmp(e.what(), "attempt to write a readonly database") == 0) {
-                is_readonly_ = true;
-            } else {
-                throw;
-            }
+        // another process holding the lock makes us wait, not fail
+        sqlite3_busy_handler(db_.getHandle(), BusyBackoff, this);
+
+        // has to be chosen before anything is written to a new database; it
+        // lets --gc give free pages back to the file system a few at a time
+        if (db_.execAndGet("PRAGMA page_count").getInt64() == 0) {
+            db_.exec("PRAGMA auto_vacuum = INCREMENTAL;");
+            // left by a cache that used to be here, whose inode this one
+            // may have been given
+            unlink((path + ".index").c_str());
+            unlink((path + ".access").c_str());
+        }
+
+        // SQLite falls back to read-only if it can't open the file for writing
+        is_readonly_ = sqlite3_db_readonly(db_.getHandle(), "main") == 1;
+        if (!is_readonly_) {
+            EnableWAL();
         }
 
+        int version = db_.execAndGet("PRAGMA user_version");
         int num_tables = db_.execAndGet("SELECT COUNT(*) from sqlite_master where type = 'table'");
-        schema_created_ = (num_tables > 0);
-        if ((!is_readonly_) && (!schema_created_)) {
+        if (num_tables == 0) {
+            if (!is_readonly_) {
+                version = InitializeTablesOnce();
+                num_tables = 1;
+            }
+        } else if (version < SCHEMA_VERSION && !is_readonly_) {
+            version = Migrate();
+        } else if (version > SCHEMA_VERSION) {
+            // written by a newer cache-dash-h. leave it alone.
+            if (verbose_) {
+                printf("%s: Cache '%s' has schema version %d, newer than %d\n",
+                       program_invocation_short_name, path.c_str(), version, SCHEMA_VERSION);
+            }
+            is_readonly_ = true;
+        }
+        schema_created_ = (num_tables > 0 || !is_readonly_) && (version == SCHEMA_VERSION);
+
+        // prepared up front, so that a lookup doesn't allocate for it the
+        // first time a fingerprint goes stale
+        if (schema_created_) {
+            memo_query_.reset(new SQLite::Statement(db_, FIND_MEMO));
+        }
+
+        // only there while `cache-dash-h --watch` is running on this cache
+        watch_.open(path);
+    }
+
+    /* Write-ahead logging lets readers carry on while another process
+       inserts, and makes a commit one append to the log. synchronous=NORMAL
+       can lose the last few commits on power loss, but never corrupts the
+       database, which is the right trade for a cache.
+    */
+    void EnableWAL() {
+        std::string mode = db_.execAndGet("PRAGMA journal_mode").getString();
+        if (mode != "wal") {
+            db_.exec("PRAGMA journal_mode = WAL;");
+        }
+        db_.exec("PRAGMA synchronous = NORMAL;");
+    }
+
+    // two processes creating the same new cache mustn't both create tables
+    int InitializeTablesOnce() {
+        WriteTransaction transaction(db_);
+        if (db_.execAndGet("SELECT COUNT(*) from sqlite_master where type = 'table'").getInt() ==
+            0) {
             InitializeTables();
         }
+        int version = db_.execAndGet("PRAGMA user_version");
+        transaction.commit();
+        return version < SCHEMA_VERSION ? Migrate() : version;
     }
 
     void InitializeTables() {
+        db_.exec(CREATE_CMDLINE_AND_OUTPUT);
         db_.exec(R"EOF(
+        CREATE TABLE file (
+            id             INTEGER PRIMARY KEY,
+            path           TEXT        NOT NULL,
+            hash           BLOB        NOT NULL UNIQUE,
+            dev            INTEGER,
+            ino            INTEGER,
+            size           INTEGER,
+            mtime_ns       INTEGER,
+            ctime_ns       INTEGER,
+            members        BLOB
+        );
+        CREATE TABLE cmdline_file (
+            cmdline_id     INTEGER     NOT NULL,
+            file_id        INTEGER     NOT NULL,
+            FOREIGN KEY (cmdline_id) REFERENCES cmdline (id),
+            FOREIGN KEY (file_id) REFERENCES file (id),
+            PRIMARY KEY (cmdline_id, file_id)
+        ) WITHOUT ROWID;
+        )EOF");
+        db_.exec(CREATE_CMDLINE_FILE_TRIGGER);
+        db_.exec(CREATE_FILE_MEMO);
+        db_.exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION) + ";");
+    }
+
+    /* Captured stdout and stderr live in the output table, stored once per
+       distinct content (keyed by its hash) and shared by every cmdline row
+       that produced it. The triggers keep output.refcount equal to the
+       number of references from cmdline, and drop blobs nothing refers to.
+    */
+    static constexpr const char* CREATE_CMDLINE_AND_OUTPUT = R"EOF(
+        CREATE TABLE output (
+            id             INTEGER PRIMARY KEY,
+            hash           BLOB        NOT NULL UNIQUE,
+            codec          INTEGER     NOT NULL,
+            data           BLOB        NOT NULL,
+            refcount       INTEGER     NOT NULL DEFAULT 0
+        );
         CREATE TABLE cmdline (
             id             INTEGER PRIMARY KEY,
             argv           TEXT        NOT NULL,
-            hash           TEXT        NOT NULL,
+            hash           BLOB        NOT NULL,
+            ctime          INTEGER     NOT NULL,
+            atime          INTEGER     NOT NULL,
+            stdout_id      INTEGER     NOT NULL,
+            stderr_id      INTEGER     NOT NULL,
+            exit_status    INTEGER     NOT NULL,
+            FOREIGN KEY (stdout_id) REFERENCES output (id),
+            FOREIGN KEY (stderr_id) REFERENCES output (id)
+        );
+        CREATE INDEX cmdline_hash ON cmdline (hash);
+        CREATE TRIGGER cmdline_ref_output AFTER INSERT ON cmdline BEGIN
+            UPDATE output SET refcount = refcount + 1 WHERE id = new.stdout_id;
+            UPDATE output SET refcount = refcount + 1 WHERE id = new.stderr_id;
+        END;
+        CREATE TRIGGER cmdline_unref_output AFTER DELETE ON cmdline BEGIN
+            UPDATE output SET refcount = refcount - 1 WHERE id = old.stdout_id;
+            UPDATE output SET refcount = refcount - 1 WHERE id = old.stderr_id;
+            DELETE FROM output WHERE id IN (old.stdout_id, old.stderr_id) AND refcount <= 0;
+        END;
+    )EOF";
+
+    // deleting a cmdline row (evicted, or by --gc) drops its links to files
+    static constexpr const char* CREATE_CMDLINE_FILE_TRIGGER = R"EOF(
+        CREATE TRIGGER IF NOT EXISTS cmdline_unlink_files AFTER DELETE ON cmdline BEGIN
+            DELETE FROM cmdline_file WHERE cmdline_id = old.id;
+        END;
+    )EOF";
+
+    /* The last hash of each file, by path, with the fingerprint it had at
+       the time. Unlike file, which holds what each entry depends on, this
+       is shared by every command: one miss doesn't re-read files another
+       command already hashed (see FindMemo). Only valid fingerprints are
+       recorded.
+    */
+    static constexpr const char* CREATE_FILE_MEMO = R"EOF(
+        CREATE TABLE IF NOT EXISTS file_memo (
+            path           TEXT        PRIMARY KEY,
+            hash           BLOB        NOT NULL,
+            dev            INTEGER     NOT NULL,
+            ino            INTEGER     NOT NULL,
+            size           INTEGER     NOT NULL,
+            mtime_ns       INTEGER     NOT NULL,
+            ctime_ns       INTEGER     NOT NULL
+        ) WITHOUT ROWID;
+    )EOF";
+
+    /* Bring an existing database up to SCHEMA_VERSION, one step at a time.
+       Returns the version we ended up at. Runs in a write transaction, so
+       two processes racing to migrate the same database can't both do it.
+
+       0: the original schema (user_version was never set)
+       1: stat fingerprint columns on file
+       2: hashes stored as 16-byte BLOBs; index on cmdline.hash; cmdline_file
+          keyed (and clustered) by (cmdline_id, file_id)
+       3: codec tags for cmdline.stdout and cmdline.stderr (see codec.h)
+       4: outputs moved to the content-addressed, refcounted output table
+       5: trigger removing cmdline_file rows with their cmdline
+       6: file_memo
+       7: file.members, for dependencies on whole trees
+    */
+    int Migrate() {
+        db_.exec("BEGIN IMMEDIATE;");
+        try {
+            int version = db_.execAndGet("PRAGMA user_version");
+            if (version < 1) {
+                MigrateToFingerprints();
+            }
+            if (version < 2) {
+                MigrateToBlobHashes();
+            }
+            if (version < 3) {
+                MigrateToCodecs();
+            }
+            if (version < 4) {
+                MigrateToOutputTable();
+            }
+            if (version < 5) {
+                db_.exec(CREATE_CMDLINE_FILE_TRIGGER);
+            }
+            if (version < 6) {
+                db_.exec(CREATE_FILE_MEMO);
+            }
+            if (version < 7 && !HasColumn("file", "members")) {
+                db_.exec("ALTER TABLE file ADD COLUMN members BLOB;");
+            }
+            if (version < SCHEMA_VERSION) {
+                version = SCHEMA_VERSION;
+                db_.exec("PRAGMA user_version = " + std::to_string(version) + ";");
+            }
+            db_.exec("COMMIT;");
+            return version;
+        } catch (...) {
+            db_.exec("ROLLBACK;");
+            throw;
+        }
+    }
+
+    bool HasColumn(const std::string& table, const std::string& column) {
+        SQLite::Statement q(db_, "PRAGMA table_info(" + table + ")");
+        while (q.executeStep()) {
+            if (column == q.getColumn("name").getText())
+                return true;
+        }
+        return false;
+    }
+
+    // NULL fingerprint columns mean "no fingerprint, always hash the content".
+    void MigrateToFingerprints() {
+        if (HasColumn("file", "mtime_ns"))
+            return;
+        db_.exec(R"EOF(
+        ALTER TABLE file ADD COLUMN dev INTEGER;
+        ALTER TABLE file ADD COLUMN ino INTEGER;
+        ALTER TABLE file ADD COLUMN size INTEGER;
+        ALTER TABLE file ADD COLUMN mtime_ns INTEGER;
+        ALTER TABLE file ADD COLUMN ctime_ns INTEGER;
+        )EOF");
+    }
+
+    // existing outputs were all stored raw, which is what the default says
+    void MigrateToCodecs() {
+        if (HasColumn("cmdline", "stdout_codec"))
+            return;
+        db_.exec(R"EOF(
+        ALTER TABLE cmdline ADD COLUMN stdout_codec INTEGER NOT NULL DEFAULT 0;
+        ALTER TABLE cmdline ADD COLUMN stderr_codec INTEGER NOT NULL DEFAULT 0;
+        )EOF");
+    }
+
+    // the old tables are renamed out of the way, the version 2 ones created,
+    // and the rows copied over with their hex hashes converted to BLOBs.
+    void MigrateToBlobHashes() {
+        db_.exec(R"EOF(
+        ALTER TABLE cmdline RENAME TO cmdline_v1;
+        ALTER TABLE file RENAME TO file_v1;
+        ALTER TABLE cmdline_file RENAME TO cmdline_file_v1;
+        CREATE TABLE cmdline (
+            id             INTEGER PRIMARY KEY,
+            argv           TEXT        NOT NULL,
+            hash           BLOB        NOT NULL,
             ctime          INTEGER     NOT NULL,
             atime          INTEGER     NOT NULL,
             stdout         TEXT        NOT NULL,
             stderr         TEXT        NOT NULL,
             exit_status    INTEGER     NOT NULL
         );
+        CREATE INDEX cmdline_hash ON cmdline (hash);
         CREATE TABLE file (
             id             INTEGER PRIMARY KEY,
             path           TEXT        NOT NULL,
-            hash           TEXT        NOT NULL UNIQUE
+            hash           BLOB        NOT NULL UNIQUE,
+            dev            INTEGER,
+            ino            INTEGER,
+            size           INTEGER,
+            mtime_ns       INTEGER,
+            ctime_ns       INTEGER
         );
         CREATE TABLE cmdline_file (
-            id             INTEGER PRIMARY KEY,
-            cmdline_id     INTEGER,
-            file_id        INTEGER,
+            cmdline_id     INTEGER     NOT NULL,
+            file_id        INTEGER     NOT NULL,
             FOREIGN KEY (cmdline_id) REFERENCES cmdline (id),
             FOREIGN KEY (file_id) REFERENCES file (id),
-            UNIQUE(cmdline_id, file_id)
-        );
+            PRIMARY KEY (cmdline_id, file_id)
+        ) WITHOUT ROWID;
         )EOF");
-        schema_created_ = true;
-    }
-    void QueryAndPrintHelpAndExitIfPossible(const std::string& cmdhash) {
-        if (!schema_created_) {
-            return;
+        db_.exec(R"EOF(
+        INSERT INTO cmdline (id, argv, hash, ctime, atime, stdout, stderr, exit_status)
+            SELECT id, argv, hash, ctime, atime, stdout, stderr, exit_status FROM cmdline_v1;
+        INSERT INTO file (id, path, hash, dev, ino, size, mtime_ns, ctime_ns)
+            SELECT id, path, hash, dev, ino, size, mtime_ns, ctime_ns FROM file_v1;
+        INSERT OR IGNORE INTO cmdline_file (cmdline_id, file_id)
+            SELECT cmdline_id, file_id FROM cmdline_file_v1
+            WHERE cmdline_id IS NOT NULL AND file_id IS NOT NULL;
+        DROP TABLE cmdline_file_v1;
+        DROP TABLE file_v1;
+        DROP TABLE cmdline_v1;
+        )EOF");
+
+        for (auto table : {"cmdline", "file"}) {
+            std::vector<std::pair<int64_t, digest_t>> rows;
+            SQLite::Statement q(db_, std::string("SELECT id, hash FROM ") + table);
+            while (q.executeStep()) {
+                digest_t digest;
+                if (parse_hex_digest(q.getColumn(1).getText(), &digest))
+                    rows.push_back({q.getColumn(0).getInt64(), digest});
+            }
+            SQLite::Statement u(db_, std::string("UPDATE ") + table + " SET hash=? WHERE id=?");
+            for (auto const& row : rows) {
+                BindDigest(u, 1, row.second);
+                u.bind(2, row.first);
+                u.exec();
+                u.reset();
+            }
         }
+    }
+
+    // cmdline is rebuilt without its output columns, and each distinct
+    // output copied into the output table once, as it was encoded.
+    void MigrateToOutputTable() {
+        // legacy_alter_table keeps cmdline_file's foreign key pointing at
+        // "cmdline", rather than following the rename
+        db_.exec(R"EOF(
+        PRAGMA legacy_alter_table = ON;
+        DROP INDEX cmdline_hash;
+        ALTER TABLE cmdline RENAME TO cmdline_v3;
+        PRAGMA legacy_alter_table = OFF;
+        )EOF");
+        db_.exec(CREATE_CMDLINE_AND_OUTPUT);
+
         SQLite::Statement q(db_, R"EOF(
-        SELECT
-            cmdline.stdout,
-            cmdline.stderr,
-            cmdline.exit_status,
-            group_concat(file.path, "::::::::::") as path,
-            group_concat(file.hash, "::::::::::") as hash,
-            cmdline.id
-        FROM cmdline
-        JOIN cmdline_file ON cmdline.id = cmdline_file.cmdline_id
-        JOIN file on cmdline_file.file_id = file.id
-        WHERE cmdline.hash = ?
-        GROUP BY cmdline.id
-        ORDER BY cmdline.id DESC;
-        )EOF");
-        q.bind(1, cmdhash);
+            SELECT id, argv, hash, ctime, atime, stdout, stdout_codec, stderr, stderr_codec,
+                   exit_status
+            FROM cmdline_v3
+        )EOF");
+        SQLite::Statement insert_cmdline(db_, R"EOF(
+            INSERT INTO cmdline (id, argv, hash, ctime, atime, stdout_id, stderr_id, exit_status)
+            VALUES (?, ?, ?, ?, ?, ?, ?, ?);
+        )EOF");
+        std::string decoded;
+        while (q.executeStep()) {
+            int64_t output_ids[2];
+            for (int i = 0; i < 2; i++) {
+                auto data = q.getColumn(5 + 2 * i);
+                int codec = q.getColumn(6 + 2 * i);
+                digest_t hash;
+                if (decode_output(codec, data.getBlob(), data.getBytes(), &decoded)) {
+                    hash = hash_bytes(decoded.data(), decoded.size());
+                } else {
+                    // we can't tell what it says, so it isn't shared
+                    hash = hash_bytes(data.getBlob(), data.getBytes());
+                    hash.bytes[0] ^= 0xff;
+                }
+                output_ids[i] = FindOutput(hash);
+                if (output_ids[i] < 0)
+                    output_ids[i] = InsertOutput(hash, codec, data.getBlob(), data.getBytes());
+            }
+            auto hash = q.getColumn(2);
+            insert_cmdline.reset();
+            insert_cmdline.bind(1, q.getColumn(0).getInt64());
+            insert_cmdline.bind(2, q.getColumn(1).getString());
+            insert_cmdline.bind(3, hash.getBlob(), hash.getBytes());
+            insert_cmdline.bind(4, q.getColumn(3).getInt64());
+            insert_cmdline.bind(5, q.getColumn(4).getInt64());
+            insert_cmdline.bind(6, output_ids[0]);
+            insert_cmdline.bind(7, output_ids[1]);
+            insert_cmdline.bind(8, q.getColumn(9).getInt());
+            insert_cmdline.exec();
+        }
+        db_.exec("DROP TABLE cmdline_v3;");
+    }
+
+    /* Prepared statements are kept for the lifetime of the connection,
+       keyed by their SQL, and come back reset with no bindings.
+    */
+    SQLite::Statement& Prepare(const std::string& sql) {
+        auto& stmt = statements_[sql];
+        if (!stmt) {
+            stmt.reset(new SQLite::Statement(db_, sql));
+        } else {
+            stmt->reset();
+            stmt->clearBindings();
+        }
+        return *stmt;
+    }
+
+    static void BindDigest(SQLite::Statement& stmt, int index, const digest_t& digest) {
+        stmt.bind(index, digest.bytes, sizeof(digest.bytes));
+    }
+
+    static void BindFingerprint(SQLite::Statement& stmt, int index, const file_fingerprint& fp) {
+        if (fp.valid) {
+            stmt.bind(index + 0, static_cast<int64_t>(fp.dev));
+            stmt.bind(index + 1, static_cast<int64_t>(fp.ino));
+            stmt.bind(index + 2, fp.size);
+            stmt.bind(index + 3, fp.mtime_ns);
+            stmt.bind(index + 4, fp.ctime_ns);
+        } else {
+            for (int i = 0; i < 5; i++)
+                stmt.bind(index + i);
+        }
+    }
+
+    /* Stream the dependencies of the cmdline row *cmdline_id* into *set*.
+       The buffers are sized up front from a count of the rows and their path
+       bytes, and keep their capacity across calls, so this doesn't allocate
+       per dependency (or at all, once they're big enough).
+    */
+    void LoadDependencies(int64_t cmdline_id, dependency_set* set) {
+        auto& sizes = Prepare(R"EOF(
+            SELECT count(*), total(length(CAST(file.path AS BLOB))) + total(length(file.members))
+            FROM cmdline_file
+            JOIN file ON cmdline_file.file_id = file.id
+            WHERE cmdline_file.cmdline_id = ?;
+        )EOF");
+        sizes.bind(1, cmdline_id);
+        sizes.executeStep();
+        size_t num_deps = static_cast<size_t>(sizes.getColumn(0).getInt64());
+        size_t path_bytes = static_cast<size_t>(sizes.getColumn(1).getDouble());
+        sizes.reset();
+
+        set->clear();
+        set->deps.reserve(num_deps);
+        set->paths.reserve(path_bytes + num_deps);
 
+        auto& q = Prepare(R"EOF(
+            SELECT file.id, file.path, file.hash,
+                   file.dev, file.ino, file.size, file.mtime_ns, file.ctime_ns, file.members
+            FROM cmdline_file
+            JOIN file ON cmdline_file.file_id = file.id
+            WHERE cmdline_file.cmdline_id = ?;
+        )EOF");
+        q.bind(1, cmdline_id);
         while (q.executeStep()) {
-            std::vector<std::string> paths;
-            std::vector<std::string> hashes;
-
-            str::split(q.getColumn("path"), "::::::::::", [&](const std::string s) {
-                if (s.size() > 0)
-                    paths.push_back(s);
-            });
-            str::split(q.getColumn("hash"), "::::::::::", [&](const std::string s) {
-                if (s.size() > 0) {
-                    hashes.push_back(s);
+            dependency_t d;
+            d.file_id = q.getColumn(0).getInt64();
+
+            auto path = q.getColumn(1);
+            const char* path_text = path.getText();
+            d.path_offset = set->paths.size();
+            set->paths.insert(set->paths.end(), path_text, path_text + path.getBytes());
+            set->paths.push_back('\0');
+
+            // a hash that isn't 16 bytes can't have come from us, and is left
+            // zeroed so the dependency never validates
+            auto hash = q.getColumn(2);
+            if (hash.getBytes() == sizeof(d.hash.bytes))
+                memcpy(d.hash.bytes, hash.getBlob(), sizeof(d.hash.bytes));
+
+            if (!q.getColumn(6).isNull()) {
+                d.fingerprint.valid = true;
+                d.fingerprint.dev = static_cast<uint64_t>(q.getColumn(3).getInt64());
+                d.fingerprint.ino = static_cast<uint64_t>(q.getColumn(4).getInt64());
+                d.fingerprint.size = q.getColumn(5).getInt64();
+                d.fingerprint.mtime_ns = q.getColumn(6).getInt64();
+                d.fingerprint.ctime_ns = q.getColumn(7).getInt64();
+            }
+
+            auto members = q.getColumn(8);
+            if (members.getBytes() > 0) {
+                auto data = static_cast<const char*>(members.getBlob());
+                d.members_offset = set->paths.size();
+                d.members_size = members.getBytes();
+                set->paths.insert(set->paths.end(), data, data + d.members_size);
+            }
+            set->deps.push_back(d);
+        }
+        q.reset();
+    }
+
+    /* Check every dependency in *set* against the file system: first by stat
+       fingerprint, then by the memo, then by content hash. The current
+       fingerprint of each file whose recorded one didn't match is left in
+       the set, for RefreshFingerprints. A tree is unchanged if the digest of
+       its members' fingerprints is.
+    */
+    bool ValidateDependencies(dependency_set* set) {
+        return parallel_all_of(set->deps.size(), [&](size_t i) {
+            dependency_t& d = set->deps[i];
+            const char* path = set->path(i);
+            if (d.members_size > 0) {
+                digest_t digest;
+                tree_digest(path, set->members(i), d.members_size, &digest);
+                return digest == d.hash;
+            }
+            if (stat_fingerprint(path, &d.current) && d.current == d.fingerprint) {
+                return true;
+            }
+            d.rehashed = true;
+            digest_t hash;
+            if (FindMemo(path, d.current, &hash))
+                return hash == d.hash;
+            return hash_filename(path, /* allow_ENOENT=*/true, &d.current) == d.hash;
+        });
+    }
+
+    /* Look up the hash of *path* in file_memo, if it was recorded with the
+       fingerprint *fp*. Hashing threads call this concurrently, so it has a
+       statement (prepared by the constructor) and a lock of its own, and any
+       error is just a miss.
+    */
+    bool FindMemo(const char* path, const file_fingerprint& fp, digest_t* hash) {
+        if (!schema_created_ || !fp.valid)
+            return false;
+        std::lock_guard<std::mutex> lock(memo_mutex_);
+        try {
+            auto& q = *memo_query_;
+            q.reset();
+            q.bind(1, path);
+            BindFingerprint(q, 2, fp);
+            bool found = false;
+            if (q.executeStep()) {
+                auto column = q.getColumn(0);
+                if (column.getBytes() == sizeof(hash->bytes)) {
+                    memcpy(hash->bytes, column.getBlob(), sizeof(hash->bytes));
+                    found = true;
                 }
-            });
-            if (paths.size() != hashes.size()) {
-                fprintf(stderr, "paths.size=%zu\n", paths.size());
-                fprintf(stderr, "hashes.size=%zu\n", hashes.size());
-                for (auto const& path : paths) {
-                    fprintf(stderr, "  %s\n", path.c_str());
+            }
+            q.reset();
+            return found;
+        } catch (const SQLite::Exception& e) {
+            return false;
+        }
+    }
+
+    hash_memo_t Memo() {
+        return [this](const char* path, const file_fingerprint& fp, digest_t* hash) {
+            return FindMemo(path, fp, hash);
+        };
+    }
+
+    void RememberHash(const char* path, const digest_t& hash, const file_fingerprint& fp) {
+        if (!fp.valid)
+            return;
+        // rewriting an unchanged row would still dirty its page
+        auto& q = Prepare(R"EOF(
+            INSERT INTO file_memo (path, hash, dev, ino, size, mtime_ns, ctime_ns)
+            VALUES (?, ?, ?, ?, ?, ?, ?)
+            ON CONFLICT (path) DO UPDATE SET
+                hash = excluded.hash, dev = excluded.dev, ino = excluded.ino,
+                size = excluded.size, mtime_ns = excluded.mtime_ns, ctime_ns = excluded.ctime_ns
+            WHERE (hash, dev, ino, size, mtime_ns, ctime_ns) !=
+                  (excluded.hash, excluded.dev, excluded.ino, excluded.size,
+                   excluded.mtime_ns, excluded.ctime_ns);
+        )EOF");
+        q.bind(1, path);
+        BindDigest(q, 2, hash);
+        BindFingerprint(q, 3, fp);
+        q.exec();
+    }
+
+    /* Find the newest cached entry for *cmdhash* whose dependencies are all
+       unchanged, and return its id, or -1. On success deps_ holds its
+       dependencies, unless the watcher vouched for them (and then it's
+       empty).
+    */
+    int64_t FindValidEntry(const digest_t& cmdhash) {
+        if (!schema_created_) {
+            return -1;
+        }
+        auto& candidates =
+            Prepare("SELECT id, ctime FROM cmdline WHERE hash = ? ORDER BY id DESC;");
+        BindDigest(candidates, 1, cmdhash);
+        while (candidates.executeStep()) {
+            int64_t cmdline_id = candidates.getColumn(0).getInt64();
+            if (watch_.is_clean(cmdline_id, candidates.getColumn(1).getInt64())) {
+                candidates.reset();
+                deps_.clear();
+                if (verbose_) {
+                    printf("%s: Entry %lld unchanged according to the watcher\n",
+                           program_invocation_short_name, static_cast<long long>(cmdline_id));
                 }
-                fprintf(stderr, "--\n");
-                for (auto const& hash : hashes) {
-                    fprintf(stderr, "  %s\n", hash.c_str());
+                return cmdline_id;
+            }
+            LoadDependencies(cmdline_id, &deps_);
+            if (deps_.deps.size() > 0 && ValidateDependencies(&deps_)) {
+                candidates.reset();
+                return cmdline_id;
+            }
+        }
+        candidates.reset();
+        return -1;
+    }
+
+    bool NeedsRefresh(const dependency_set& set) {
+        return std::any_of(set.deps.begin(), set.deps.end(), [](const dependency_t& d) {
+            return d.rehashed && d.current.valid;
+        });
+    }
+
+    // files whose content matched even though their fingerprint didn't get
+    // their fingerprint refreshed, so the next hit is cheap.
+    void RefreshFingerprints(const dependency_set& set) {
+        auto& f = Prepare(UPDATE_FINGERPRINT);
+        for (size_t i = 0; i < set.deps.size(); i++) {
+            auto const& d = set.deps[i];
+            if (!d.rehashed || !d.current.valid)
+                continue;
+            f.reset();
+            BindFingerprint(f, 1, d.current);
+            f.bind(6, d.file_id);
+            f.exec();
+            RememberHash(set.path(i), d.hash, d.current);
+        }
+    }
+
+    /* The newest entry for *cmdhash* at most stale_max_age_ seconds old,
+       valid or not, that this build can print, or -1. Sets *age* to its age
+       in seconds.
+    */
+    int64_t FindRecentEntry(const digest_t& cmdhash, int64_t* age) {
+        if (!schema_created_ || stale_max_age_ <= 0) {
+            return -1;
+        }
+        auto& q = Prepare(R"EOF(
+            SELECT cmdline.id, cmdline.ctime, o.codec, e.codec
+            FROM cmdline
+            JOIN output o ON o.id = cmdline.stdout_id
+            JOIN output e ON e.id = cmdline.stderr_id
+            WHERE cmdline.hash = ? AND cmdline.ctime >= ?
+            ORDER BY cmdline.id DESC LIMIT 1;
+        )EOF");
+        BindDigest(q, 1, cmdhash);
+        int64_t now = static_cast<int64_t>(std::time(nullptr));
+        q.bind(2, now - stale_max_age_);
+        int64_t cmdline_id = -1;
+        if (q.executeStep() && codec_supported(q.getColumn(2).getInt()) &&
+            codec_supported(q.getColumn(3).getInt())) {
+            cmdline_id = q.getColumn(0).getInt64();
+            *age = now - q.getColumn(1).getInt64();
+        }
+        q.reset();
+        return cmdline_id;
+    }
+
+    void QueryAndPrintHelpAndExitIfPossible(const digest_t& cmdhash) {
+        int64_t cmdline_id = FindValidEntry(cmdhash);
+        if (cmdline_id < 0) {
+            // stale-while-revalidate: the old output now, and a re-run
+            // that replaces it for next time
+            // (only where something can do the re-run, and only once it's
+            // known the old output can be printed)
+            int64_t age = 0;
+            if (revalidate_) {
+                cmdline_id = FindRecentEntry(cmdhash, &age);
+            }
+            if (cmdline_id < 0) {
+                return;
+            }
+            if (verbose_) {
+                printf("%s: Serving a stale result, %lld seconds old, and refreshing it in "
+                       "the background\n",
+                       program_invocation_short_name, static_cast<long long>(age));
+            }
+            revalidate_();
+            PrintAndExit(cmdline_id);
+            return;
+        }
+
+        // bookkeeping goes first: once the output has been handed to a pipe
+        // the blob memory behind it must not change
+        RecordHit(cmdhash, cmdline_id);
+        PrintAndExit(cmdline_id);
+    }
+
+    /* Like QueryAndPrintHelpAndExitIfPossible, but hands the output of a
+       valid entry for *cmdhash* (still encoded) to the caller instead of
+       printing it, and returns false on a miss. Stale results aren't served.
+    */
+    bool Lookup(const digest_t& cmdhash, index_entry* entry) {
+        int64_t cmdline_id = FindValidEntry(cmdhash);
+        if (cmdline_id < 0 || !LoadOutputs(cmdline_id, entry))
+            return false;
+        RecordHit(cmdhash, cmdline_id);
+        return true;
+    }
+
+    /* The bookkeeping after a hit on *cmdline_id*, just found by
+       FindValidEntry. It's only an optimization, so a hit doesn't fail if
+       the lock stays busy. The access time goes to the access log, so most
+       hits write nothing to the database at all.
+    */
+    void RecordHit(const digest_t& cmdhash, int64_t cmdline_id) {
+        if (!is_readonly_) {
+            try {
+                bool fold_log = log_access(path_, cmdline_id) > ACCESS_LOG_MAX_SIZE;
+                bool refresh = NeedsRefresh(deps_);
+                if (fold_log || refresh) {
+                    WriteTransaction transaction(db_);
+                    if (fold_log)
+                        ApplyAccessLog();
+                    RefreshFingerprints(deps_);
+                    transaction.commit();
                 }
-                throw std::runtime_error("sizes don't match\n");
-            }
-            bool match = true;
-            size_t i;
-            for (i = 0; i < paths.size(); i++) {
-                if (hash_filename(paths[i], /* allow_ENOENT=*/true) != hashes[i]) {
-                    // printf("nomatch %s (got=%s) exp=%s\n", paths[i].c_str(),
-                    // hash_filename(paths[i]).c_str(),
-                    //       hashes[i].c_str());
-                    match = false;
-                    break;
+
+                // so that the next hit can come from the index. usually it's
+                // there already, and if the index is full, the next insert
+                // rebuilds it.
+                if (IsIndexable(deps_) &&
+                    (refresh || !lookup_index::contains(path_, cmdhash, cmdline_id))) {
+                    index_entry entry;
+                    if (LoadIndexEntry(cmdline_id, &entry))
+                        lookup_index::append(path_, entry);
                 }
-            }
-            if ((i > 0) && match) {
-                std::string stdout_ = q.getColumn("stdout");
-                std::string stderr_ = q.getColumn("stderr");
-                int exit_status = q.getColumn("exit_status");
-                printf("%s", stdout_.c_str());
-                fprintf(stderr, "%s", stderr_.c_str());
+            } catch (const SQLite::Exception& e) {
                 if (verbose_) {
-                    printf("%s: Read from cache '%s'\n", program_invocation_short_name,
-                           db_.getFilename().c_str());
-                }
-                if (!is_readonly_) {
-                    SQLite::Statement u(db_, "UPDATE cmdline SET atime=? WHERE id=?");
-                    u.bind(1, std::time(nullptr));
-                    u.bind(2, q.getColumn("id").getText());
-                    u.exec();
+                    printf("%s: Can't update '%s': %s\n", program_invocation_short_name,
+                           db_.getFilename().c_str(), e.what());
                 }
-                exit(exit_status);
             }
         }
-        return;
     }
 
-    int Insert(const std::vector<std::string>& cmd,
-               const std::string& cmdhash,
-               const std::tuple<std::string, std::string, int>& output,
-               const std::vector<std::string>& depfiles) {
-        // Begin transaction
-        SQLite::Transaction transaction(db_);
+    /* Write the output of the entry *cmdline_id* and exit with its status.
+       Returns only if this build can't decode it.
+    */
+    void PrintAndExit(int64_t cmdline_id) {
+        // replayed straight from SQLite's memory, NUL bytes and all
+        auto& q = Prepare(R"EOF(
+            SELECT o.data, e.data, cmdline.exit_status, o.codec, e.codec
+            FROM cmdline
+            JOIN output o ON o.id = cmdline.stdout_id
+            JOIN output e ON e.id = cmdline.stderr_id
+            WHERE cmdline.id = ?;
+        )EOF");
+        q.bind(1, cmdline_id);
+        q.executeStep();
+        auto stdout_ = q.getColumn(0);
+        auto stderr_ = q.getColumn(1);
+        int exit_status = q.getColumn(2);
+        int stdout_codec = q.getColumn(3);
+        int stderr_codec = q.getColumn(4);
+        if (!codec_supported(stdout_codec) || !codec_supported(stderr_codec)) {
+            // written by a build with a codec this one lacks: run the command
+            q.reset();
+            return;
+        }
+        fflush(stdout);
+        if (!write_decoded_output(STDOUT_FILENO, stdout_codec, stdout_.getBlob(),
+                                  stdout_.getBytes()) ||
+            !write_decoded_output(STDERR_FILENO, stderr_codec, stderr_.getBlob(),
+                                  stderr_.getBytes())) {
+            error_msg_and_die("Corrupt output for entry %lld in '%s'",
+                              static_cast<long long>(cmdline_id), db_.getFilename().c_str());
+        }
+        if (verbose_) {
+            printf("%s: Read from cache '%s'\n", program_invocation_short_name,
+                   db_.getFilename().c_str());
+        }
+        exit(exit_status);
+    }
+
+    // returns the id of the new entry
+    int64_t Insert(const std::vector<std::string>& cmd,
+                   const digest_t& cmdhash,
+                   const std::tuple<std::string, std::string, int>& output,
+                   const std::vector<hashed_file>& depfiles) {
+        // everything slow happens before we take the write lock, so other
+        // writers only ever wait for the inserts themselves (the files were
+        // hashed by a dependency_hasher while the command ran)
+        auto stdout_ = EncodeOutput(std::get<0>(output));
+        auto stderr_ = EncodeOutput(std::get<1>(output));
+
+        WriteTransaction transaction(db_);
+        int64_t stdout_id = StoreOutput(std::get<0>(output), stdout_);
+        int64_t stderr_id = StoreOutput(std::get<1>(output), stderr_);
 
-        SQLite::Statement insert1(db_, R"EOF(
-            INSERT INTO cmdline (id, argv, hash, ctime, atime, stdout, stderr, exit_status)
+        auto& insert_cmdline = Prepare(R"EOF(
+            INSERT INTO cmdline (id, argv, hash, ctime, atime, stdout_id, stderr_id, exit_status)
             VALUES (NULL, ?, ?, ?, ?, ?, ?, ?);
         )EOF");
         auto time = std::time(nullptr);
-        insert1.bind(1, str::join(cmd, " "));
-        insert1.bind(2, cmdhash);
-        insert1.bind(3, time);
-        insert1.bind(4, time);
-        insert1.bind(5, std::get<0>(output));
-        insert1.bind(6, std::get<1>(output));
-        insert1.bind(7, std::get<2>(output));
-
-        insert1.exec();
+        insert_cmdline.bind(1, str::join(cmd, " "));
+        BindDigest(insert_cmdline, 2, cmdhash);
+        insert_cmdline.bind(3, time);
+        insert_cmdline.bind(4, time);
+        insert_cmdline.bind(5, stdout_id);
+        insert_cmdline.bind(6, stderr_id);
+        insert_cmdline.bind(7, std::get<2>(output));
+
+        insert_cmdline.exec();
         auto cmdline_id = db_.getLastInsertRowid();
 
-        for (auto const& path : depfiles) {
-            auto hash = hash_filename(path, /*allow_ENOENT=*/false);
-            SQLite::Statement insert2(db_, R"EOF(
-                INSERT OR IGNORE INTO file (id, path, hash)
-                VALUES (NULL, ?, ?);
-            )EOF");
-            insert2.bind(1, path);
-            insert2.bind(2, hash);
+        auto& insert_file = Prepare(R"EOF(
+            INSERT OR IGNORE INTO file
+                (id, path, hash, dev, ino, size, mtime_ns, ctime_ns, members)
+            VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);
+        )EOF");
+        auto& select_file = Prepare("SELECT id from file where hash=?");
+        auto& update_fingerprint = Prepare(UPDATE_FINGERPRINT);
+        auto& insert_link = Prepare(
+            "INSERT OR IGNORE INTO cmdline_file (cmdline_id, file_id) VALUES(?, ?);");
+
+        for (auto const& dep : depfiles) {
+            auto const& hash = dep.hash;
+            auto const& fp = dep.fingerprint;
+            insert_file.reset();
+            insert_file.bind(1, dep.path);
+            BindDigest(insert_file, 2, hash);
+            BindFingerprint(insert_file, 3, fp);
+            if (dep.members.empty()) {
+                insert_file.bind(8);
+            } else {
+                insert_file.bind(8, dep.members.data(), static_cast<int>(dep.members.size()));
+            }
 
             int64_t file_id;
-            if (insert2.exec() == 0) {
-                SQLite::Statement q(db_, "SELECT id from file where hash=?");
-                q.bind(1, hash);
-                q.executeStep();
-                file_id = q.getColumn(0);
+            if (insert_file.exec() == 0) {
+                select_file.reset();
+                BindDigest(select_file, 1, hash);
+                select_file.executeStep();
+                file_id = select_file.getColumn(0).getInt64();
+                select_file.reset();
+
+                // same content as before, but the inode or timestamps may
+                // have moved on since that row was written.
+                update_fingerprint.reset();
+                BindFingerprint(update_fingerprint, 1, fp);
+                update_fingerprint.bind(6, file_id);
+                update_fingerprint.exec();
             } else {
                 file_id = db_.getLastInsertRowid();
             }
 
-            SQLite::Statement ii(
-                db_,
-                "INSERT OR IGNORE INTO cmdline_file (id, cmdline_id, file_id) VALUES(NULL, ?, ?);");
-            ii.bind(1, cmdline_id);
-            ii.bind(2, file_id);
-            ii.exec();
+            insert_link.reset();
+            insert_link.bind(1, cmdline_id);
+            insert_link.bind(2, file_id);
+            insert_link.exec();
+
+            RememberHash(dep.path.c_str(), hash, fp);
         }
         transaction.commit();
+        return cmdline_id;
+    }
+
+    // whether LoadIndexEntry would succeed for the entry behind *set*
+    static bool IsIndexable(const dependency_set& set) {
+        return !set.deps.empty() &&
+               std::all_of(set.deps.begin(), set.deps.end(), [](const dependency_t& d) {
+                   return d.members_size > 0 || d.fingerprint.valid ||
+                          (d.rehashed && d.current.valid);
+               });
+    }
+
+    /* Everything the lookup index needs to serve the entry *cmdline_id*.
+       False if some dependency has no fingerprint to check it by, since
+       then only ValidateDependencies can.
+    */
+    bool LoadIndexEntry(int64_t cmdline_id, index_entry* entry) {
+        dependency_set set;
+        LoadDependencies(cmdline_id, &set);
+        if (set.deps.empty())
+            return false;
+        entry->deps.clear();
+        for (size_t i = 0; i < set.deps.size(); i++) {
+            auto const& d = set.deps[i];
+            index_dep dep;
+            dep.path = set.path(i);
+            if (d.members_size > 0) {
+                dep.hash = d.hash;
+                dep.members.assign(set.members(i), d.members_size);
+            } else if (d.fingerprint.valid) {
+                dep.fingerprint = d.fingerprint;
+            } else {
+                return false;
+            }
+            entry->deps.push_back(std::move(dep));
+        }
+        return LoadOutputs(cmdline_id, entry);
+    }
+
+    // the entry's outputs, still encoded, and exit status, into *entry*
+    bool LoadOutputs(int64_t cmdline_id, index_entry* entry) {
+        auto& q = Prepare(R"EOF(
+            SELECT cmdline.hash, cmdline.exit_status, o.codec, o.data, e.codec, e.data
+            FROM cmdline
+            JOIN output o ON o.id = cmdline.stdout_id
+            JOIN output e ON e.id = cmdline.stderr_id
+            WHERE cmdline.id = ?;
+        )EOF");
+        q.bind(1, cmdline_id);
+        if (!q.executeStep() || q.getColumn(0).getBytes() != sizeof(entry->cmdhash.bytes)) {
+            q.reset();
+            return false;
+        }
+        memcpy(entry->cmdhash.bytes, q.getColumn(0).getBlob(), sizeof(entry->cmdhash.bytes));
+        entry->cmdline_id = cmdline_id;
+        entry->exit_status = q.getColumn(1).getInt();
+        for (int i = 0; i < 2; i++) {
+            auto data = q.getColumn(3 + 2 * i);
+            entry->codecs[i] = q.getColumn(2 + 2 * i).getInt();
+            entry->outputs[i].assign(static_cast<const char*>(data.getBlob()), data.getBytes());
+        }
+        q.reset();
+        return true;
+    }
+
+    // point the lookup index at the entry *cmdline_id*, if it can serve it
+    void UpdateIndex(int64_t cmdline_id) {
+        index_entry entry;
+        if (LoadIndexEntry(cmdline_id, &entry) && !lookup_index::append(path_, entry)) {
+            RebuildIndex();
+        }
+    }
+
+    // index the newest entry for every command from scratch
+    void RebuildIndex() {
+        lookup_index::rebuild(path_, [&](std::vector<index_entry>* entries) {
+            SQLite::Statement q(db_, "SELECT max(id) FROM cmdline GROUP BY hash");
+            while (q.executeStep()) {
+                index_entry entry;
+                if (LoadIndexEntry(q.getColumn(0).getInt64(), &entry))
+                    entries->push_back(std::move(entry));
+            }
+        });
+    }
+
+    struct encoded_output_t {
+        digest_t hash;
+        int codec;
+        std::string encoded; // unused for CODEC_NONE
+    };
+
+    encoded_output_t EncodeOutput(const std::string& data) {
+        encoded_output_t e;
+        e.hash = hash_bytes(data.data(), data.size());
+        e.codec = compress_ ? encode_output(data, &e.encoded) : CODEC_NONE;
+        return e;
+    }
+
+    /* Return the id of the output row holding *data*, adding one if this
+       content hasn't been stored before. A new row starts with no
+       references; inserting the cmdline row that uses it adds one.
+    */
+    int64_t StoreOutput(const std::string& data, const encoded_output_t& e) {
+        int64_t id = FindOutput(e.hash);
+        if (id >= 0)
+            return id;
+        const std::string& stored = e.codec == CODEC_NONE ? data : e.encoded;
+        return InsertOutput(e.hash, e.codec, stored.data(), stored.size());
+    }
+
+    int64_t FindOutput(const digest_t& hash) {
+        auto& q = Prepare("SELECT id FROM output WHERE hash=?");
+        BindDigest(q, 1, hash);
+        int64_t id = q.executeStep() ? q.getColumn(0).getInt64() : -1;
+        q.reset();
+        return id;
+    }
+
+    int64_t InsertOutput(const digest_t& hash, int codec, const void* data, size_t len) {
+        auto& insert_output = Prepare("INSERT INTO output (hash, codec, data) VALUES (?, ?, ?);");
+        BindDigest(insert_output, 1, hash);
+        insert_output.bind(2, codec);
+        // an empty blob comes back from SQLite as NULL
+        insert_output.bind(3, len > 0 ? data : "", static_cast<int>(len));
+        insert_output.exec();
+        return db_.getLastInsertRowid();
+    }
+
+    /* Delete the least recently used entries until there are at most
+       max_entries_ of them and the live pages take at most max_size_ bytes
+       (when those are set). The newest entry is never evicted.
+    */
+    void Evict() {
+        if (is_readonly_ || (max_entries_ <= 0 && max_size_ <= 0))
+            return;
+        WriteTransaction transaction(db_);
+        ApplyAccessLog();
+        int64_t num_entries = db_.execAndGet("SELECT count(*) FROM cmdline").getInt64();
+        int64_t num_evicted = 0;
+        if (max_entries_ > 0 && num_entries > max_entries_) {
+            num_evicted += DeleteLeastRecentlyUsed(num_entries - max_entries_);
+            DeleteOrphans();
+        }
+        while (max_size_ > 0 && num_entries - num_evicted > 1 && LiveBytes() > max_size_) {
+            // freed pages only show up once the orphans are gone too
+            num_evicted +=
+                DeleteLeastRecentlyUsed(std::max<int64_t>(1, (num_entries - num_evicted) / 8));
+            DeleteOrphans();
+        }
+        transaction.commit();
+        if (num_evicted > 0) {
+            // or the index would go on serving them
+            RebuildIndex();
+        }
+        if (verbose_ && num_evicted > 0) {
+            printf("%s: Evicted %lld entries from '%s'\n", program_invocation_short_name,
+                   static_cast<long long>(num_evicted), db_.getFilename().c_str());
+        }
+    }
+
+    // move the access times recorded by hits (see access_log.h) into cmdline
+    void ApplyAccessLog() {
+        auto& u = Prepare("UPDATE cmdline SET atime = ? WHERE id = ? AND atime < ?");
+        for (auto const& access : take_access_log(path_)) {
+            u.reset();
+            u.bind(1, access.second);
+            u.bind(2, access.first);
+            u.bind(3, access.second);
+            u.exec();
+        }
+    }
+
+    int64_t DeleteLeastRecentlyUsed(int64_t n) {
+        auto& d = Prepare(R"EOF(
+            DELETE FROM cmdline WHERE id IN (
+                SELECT id FROM cmdline ORDER BY atime, id LIMIT ?
+            );
+        )EOF");
+        d.bind(1, n);
+        return d.exec();
+    }
+
+    // bytes in pages that hold data, i.e. what the file would shrink to
+    int64_t LiveBytes() {
+        int64_t page_count = db_.execAndGet("PRAGMA page_count").getInt64();
+        int64_t freelist_count = db_.execAndGet("PRAGMA freelist_count").getInt64();
+        int64_t page_size = db_.execAndGet("PRAGMA page_size").getInt64();
+        return (page_count - freelist_count) * page_size;
+    }
+
+    /* Remove rows nothing refers to any more: links to deleted entries,
+       files no entry depends on, and outputs no entry printed. The triggers
+       handle the last two for rows deleted since schema version 5, so this
+       is mostly for files, which are shared between entries.
+    */
+    void DeleteOrphans() {
+        db_.exec(R"EOF(
+        DELETE FROM cmdline_file WHERE cmdline_id NOT IN (SELECT id FROM cmdline);
+        DELETE FROM file WHERE id NOT IN (SELECT file_id FROM cmdline_file);
+        DELETE FROM file_memo WHERE path NOT IN (SELECT path FROM file);
+        DELETE FROM output WHERE id NOT IN (
+            SELECT stdout_id FROM cmdline UNION SELECT stderr_id FROM cmdline
+        );
+        )EOF");
+    }
+
+    /* --gc: delete every entry that a lookup would never serve again, i.e.
+       those whose dependencies changed and those shadowed by a newer valid
+       entry for the same command, then the orphaned rows, then return the
+       free pages to the file system. Returns the number of entries deleted.
+    */
+    int64_t CollectGarbage() {
+        if (is_readonly_ || !schema_created_)
+            return 0;
+
+        std::vector<int64_t> stale;
+        {
+            SQLite::Statement q(db_, "SELECT id, hash FROM cmdline ORDER BY hash, id DESC");
+            digest_t current{};
+            bool have_current = false, found_valid = false;
+            while (q.executeStep()) {
+                digest_t hash{};
+                auto column = q.getColumn(1);
+                if (column.getBytes() == sizeof(hash.bytes))
+                    memcpy(hash.bytes, column.getBlob(), sizeof(hash.bytes));
+                if (!have_current || hash != current) {
+                    current = hash;
+                    have_current = true;
+                    found_valid = false;
+                }
+
+                int64_t cmdline_id = q.getColumn(0).getInt64();
+                if (!found_valid) {
+                    LoadDependencies(cmdline_id, &deps_);
+                    found_valid = deps_.deps.size() > 0 && ValidateDependencies(&deps_);
+                    if (found_valid)
+                        continue;
+                }
+                stale.push_back(cmdline_id);
+            }
+        }
+
+        WriteTransaction transaction(db_);
+        ApplyAccessLog();
+        auto& d = Prepare("DELETE FROM cmdline WHERE id = ?");
+        for (auto cmdline_id : stale) {
+            d.reset();
+            d.bind(1, cmdline_id);
+            d.exec();
+        }
+        DeleteOrphans();
+        transaction.commit();
+
+        RebuildIndex();
+        Compact();
+        return static_cast<int64_t>(stale.size());
+    }
+
+    /* Give free pages back to the file system, in small transactions so
+       other processes using the cache aren't locked out for long. A cache
+       created before auto_vacuum was turned on needs one full VACUUM first.
+    */
+    void Compact() {
+        int auto_vacuum = db_.execAndGet("PRAGMA auto_vacuum").getInt();
+        if (auto_vacuum != 2) {
+            db_.exec("PRAGMA auto_vacuum = INCREMENTAL;");
+            db_.exec("VACUUM;");
+            return;
+        }
+        int64_t free_pages = db_.execAndGet("PRAGMA freelist_count").getInt64();
+        while (free_pages > 0) {
+            db_.exec("PRAGMA incremental_vacuum(" + std::to_string(COMPACT_PAGES) + ");");
+            int64_t left = db_.execAndGet("PRAGMA freelist_count").getInt64();
+            if (left >= free_pages)
+                break;
+            free_pages = left;
+        }
+    }
+
+    static const int COMPACT_PAGES = 256;
+
+    /* sqlite3_busy_handler callback: sleep with exponential backoff (and
+       jitter, so a crowd of waiters doesn't wake up in lockstep) until the
+       lock is free or we've waited BUSY_TIMEOUT_MS in total, after which
+       the statement fails with SQLITE_BUSY.
+    */
+    static int BusyBackoff(void* arg, int count) {
+        auto self = static_cast<Database*>(arg);
+        if (count == 0)
+            self->busy_waited_ms_ = 0;
+        if (self->busy_waited_ms_ >= BUSY_TIMEOUT_MS)
+            return 0;
+        int ms = 1 << std::min(count, 6);
+        ms = ms / 2 + rand_r(&self->busy_seed_) % (ms / 2 + 1);
+        usleep(ms * 1000);
+        self->busy_waited_ms_ += ms;
         return 1;
     }
 
+    static const int BUSY_TIMEOUT_MS = 10000;
+
+    static constexpr const char* FIND_MEMO = R"EOF(
+        SELECT hash FROM file_memo
+        WHERE path = ? AND dev = ? AND ino = ? AND size = ? AND mtime_ns = ? AND ctime_ns = ?
+    )EOF";
+
+    static constexpr const char* UPDATE_FINGERPRINT = R"EOF(
+        UPDATE file SET dev=?, ino=?, size=?, mtime_ns=?, ctime_ns=?
+        WHERE id=?
+    )EOF";
+
     SQLite::Database db_;
+    std::string path_;
     bool verbose_;
     bool is_readonly_;
     bool schema_created_;
+    bool compress_{true};
+    int64_t max_entries_{0}; // 0: unlimited
+    int64_t max_size_{0};    // bytes; 0: unlimited
+    int64_t stale_max_age_{0}; // seconds; 0: never serve invalid entries
+    std::function<void()> revalidate_;
+    int busy_waited_ms_{0};
+    unsigned busy_seed_{static_cast<unsigned>(getpid())};
+    std::map<std::string, std::unique_ptr<SQLite::Statement>> statements_;
+    dependency_set deps_;
+    std::mutex memo_mutex_;
+    std::unique_ptr<SQLite::Statement> memo_query_;
+    watch_table watch_;
 };
 
 } // namespace cache_dash_h
\ No newline at end of file
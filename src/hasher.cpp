@@ -0,0 +1,98 @@
+#include "hasher.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace cache_dash_h {
+
+// the tracer and the output tee need some of the machine too
+static const unsigned MAX_HASHER_THREADS = 4;
+
+dependency_hasher::dependency_hasher(hash_memo_t memo, std::vector<std::string> trees)
+    : memo_(std::move(memo)), trees_(std::move(trees)), tree_members_(trees_.size()) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned num_threads = std::min(cores, MAX_HASHER_THREADS);
+    for (unsigned t = 0; t < num_threads; t++)
+        threads_.emplace_back(&dependency_hasher::run, this);
+}
+
+dependency_hasher::~dependency_hasher() {
+    if (!threads_.empty())
+        finish();
+}
+
+void dependency_hasher::add(const std::string& path) {
+    if (!seen_.insert(path).second)
+        return;
+    for (size_t i = 0; i < trees_.size(); i++) {
+        if (path.size() > trees_[i].size() && str::startswith(path, trees_[i])) {
+            tree_members_[i].push_back(path.substr(trees_[i].size()));
+            return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        files_.emplace_back();
+        files_.back().path = path;
+    }
+    cond_.notify_one();
+}
+
+std::vector<hashed_file> dependency_hasher::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+    std::vector<hashed_file> files(std::make_move_iterator(files_.begin()),
+                                   std::make_move_iterator(files_.end()));
+
+    for (size_t i = 0; i < trees_.size(); i++) {
+        auto& members = tree_members_[i];
+        if (members.empty())
+            continue;
+        // the digest mustn't depend on the order the command opened them in
+        std::sort(members.begin(), members.end());
+        hashed_file tree;
+        tree.path = trees_[i];
+        for (auto const& member : members) {
+            tree.members += member;
+            tree.members.push_back('\0');
+        }
+        if (tree_digest(tree.path.c_str(), tree.members.data(), tree.members.size(), &tree.hash)) {
+            files.push_back(std::move(tree));
+            continue;
+        }
+        for (auto const& member : members) {
+            hashed_file file;
+            file.path = trees_[i] + member;
+            file.hash =
+                hash_filename(file.path.c_str(), /*allow_ENOENT=*/true, &file.fingerprint, memo_);
+            files.push_back(std::move(file));
+        }
+    }
+    return files;
+}
+
+void dependency_hasher::run() {
+    while (1) {
+        hashed_file* file;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&]() { return next_ < files_.size() || done_; });
+            if (next_ == files_.size())
+                return;
+            file = &files_[next_++];
+        }
+        // the command may have deleted the file since opening it (temporary
+        // files, say). It's hashed as missing then, which is also what a
+        // lookup will find.
+        file->hash =
+            hash_filename(file->path.c_str(), /*allow_ENOENT=*/true, &file->fingerprint, memo_);
+    }
+}
+
+}; // namespace cache_dash_h
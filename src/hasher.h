@@ -0,0 +1,64 @@
+#pragma once
+#include "utils.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace cache_dash_h {
+
+/* A dependency ready to be stored: either one file and the hash of its
+   content, or a whole tree (see tree_digest), whose path is the tree's
+   root and whose members are listed NUL-terminated in *members*.
+*/
+struct hashed_file {
+    std::string path;
+    digest_t hash;
+    file_fingerprint fingerprint;
+    std::string members;
+};
+
+/* Hashes dependencies on a pool of worker threads as the tracer reports
+   them, so that by the time the traced command exits most of its files are
+   already done. Each distinct path is hashed once.
+
+   add() is only ever called from one thread (the tracer's). Files *memo*
+   already knows aren't read (see hash_filename).
+
+   Files under one of *trees* aren't hashed at all, but collected, and
+   finish() turns each tree into a single dependency on the fingerprints of
+   its files. If some of them changed too recently for that, they're
+   hashed one by one like any other file instead.
+*/
+class dependency_hasher {
+  public:
+    explicit dependency_hasher(hash_memo_t memo = nullptr,
+                               std::vector<std::string> trees = std::vector<std::string>());
+    ~dependency_hasher();
+
+    void add(const std::string& path);
+
+    // wait for the workers, and return every file in the order first added
+    std::vector<hashed_file> finish();
+
+  private:
+    void run();
+
+    hash_memo_t memo_;
+    std::vector<std::string> trees_;
+    std::vector<std::vector<std::string>> tree_members_; // relative to trees_[i]
+    std::unordered_set<std::string> seen_;
+    // a deque, so that workers can fill in entries while add() appends
+    std::deque<hashed_file> files_;
+    size_t next_{0};
+    bool done_{false};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::thread> threads_;
+};
+
+}; // namespace cache_dash_h
@@ -0,0 +1,8 @@
+#pragma once
+
+/* The arguments that make a command print its help. Each row holds flags
+   that mean the same thing; the first is the one hashed for all of them.
+   Plain C, for the executable's front end (see main.cpp) as well.
+*/
+static const char* const HELP_FLAGS[][2] = {
+    {"-h", "--help"}, {"-showparams", "--showparams"}, {"-hh", "--help-all"}};
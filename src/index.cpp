@@ -0,0 +1,391 @@
+#include "index.h"
+#include "access_log.h"
+#include "codec.h"
+#include "error_prints.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cache_dash_h {
+
+static const uint64_t INDEX_MAGIC = 0x63646869647831ULL; // "cdhidx1"
+static const uint64_t INDEX_MIN_SLOTS = 4096;
+// replaced records may take up this much before the index is rebuilt
+static const uint64_t INDEX_MIN_GARBAGE = 1 << 20;
+
+struct index_header {
+    uint64_t magic;
+    // the database file it was built from: one deleted and created again
+    // doesn't inherit the old one's index
+    uint64_t db_dev;
+    uint64_t db_ino;
+    uint64_t num_slots;
+    uint64_t num_used;
+    uint64_t live_bytes; // in records some slot points at
+};
+
+struct index_slot {
+    unsigned char cmdhash[16];
+    std::atomic<uint64_t> offset; // 0: empty
+};
+
+struct lookup_index::record_header {
+    uint64_t size; // of the whole record, a multiple of 8
+    int64_t cmdline_id;
+    int32_t exit_status;
+    int32_t codecs[2];
+    uint32_t num_deps;
+    uint64_t output_sizes[2];
+};
+
+// each dependency, followed by its path and members, padded to 8 bytes
+struct dep_header {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    unsigned char hash[16];
+    uint32_t path_len;
+    uint32_t members_len;
+};
+
+static size_t padded(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+static bool same_database(const index_header& header, const std::string& db_path) {
+    struct stat statbuf;
+    return stat(db_path.c_str(), &statbuf) == 0 && header.db_dev == statbuf.st_dev &&
+           header.db_ino == statbuf.st_ino;
+}
+
+static size_t table_size(uint64_t num_slots) {
+    return sizeof(index_header) + num_slots * sizeof(index_slot);
+}
+
+static uint64_t first_slot(const digest_t& cmdhash) {
+    uint64_t x;
+    memcpy(&x, cmdhash.bytes, sizeof(x));
+    return x;
+}
+
+static void append_bytes(std::string* buf, const void* data, size_t len) {
+    buf->append(static_cast<const char*>(data), len);
+    buf->resize(padded(buf->size()), '\0');
+}
+
+std::string lookup_index::serialize(const index_entry& entry) {
+    std::string buf(sizeof(record_header), '\0');
+    for (auto const& dep : entry.deps) {
+        dep_header d = {};
+        d.dev = dep.fingerprint.dev;
+        d.ino = dep.fingerprint.ino;
+        d.size = dep.fingerprint.size;
+        d.mtime_ns = dep.fingerprint.mtime_ns;
+        d.ctime_ns = dep.fingerprint.ctime_ns;
+        memcpy(d.hash, dep.hash.bytes, sizeof(d.hash));
+        d.path_len = static_cast<uint32_t>(dep.path.size());
+        d.members_len = static_cast<uint32_t>(dep.members.size());
+        buf.append(reinterpret_cast<const char*>(&d), sizeof(d));
+        buf.append(dep.path.c_str(), dep.path.size() + 1);
+        append_bytes(&buf, dep.members.data(), dep.members.size());
+    }
+    for (int i = 0; i < 2; i++)
+        append_bytes(&buf, entry.outputs[i].data(), entry.outputs[i].size());
+
+    record_header h = {};
+    h.size = buf.size();
+    h.cmdline_id = entry.cmdline_id;
+    h.exit_status = entry.exit_status;
+    h.codecs[0] = entry.codecs[0];
+    h.codecs[1] = entry.codecs[1];
+    h.num_deps = static_cast<uint32_t>(entry.deps.size());
+    h.output_sizes[0] = entry.outputs[0].size();
+    h.output_sizes[1] = entry.outputs[1].size();
+    memcpy(&buf[0], &h, sizeof(h));
+    return buf;
+}
+
+lookup_index::~lookup_index() {
+    if (data_ != nullptr)
+        munmap(const_cast<char*>(data_), size_);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool lookup_index::open(const std::string& db_path) {
+    fd_ = ::open((db_path + ".index").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+        return false;
+    struct stat statbuf;
+    if (fstat(fd_, &statbuf) < 0 || static_cast<size_t>(statbuf.st_size) < sizeof(index_header))
+        return false;
+    size_ = statbuf.st_size;
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+        return false;
+    data_ = static_cast<const char*>(p);
+    db_path_ = db_path;
+
+    auto header = reinterpret_cast<const index_header*>(data_);
+    if (header->magic != INDEX_MAGIC || header->num_slots == 0 ||
+        (header->num_slots & (header->num_slots - 1)) != 0 ||
+        table_size(header->num_slots) > size_ || !same_database(*header, db_path)) {
+        munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+        return false;
+    }
+    return true;
+}
+
+const lookup_index::record_header* lookup_index::find(const digest_t& cmdhash) const {
+    if (data_ == nullptr)
+        return nullptr;
+    auto header = reinterpret_cast<const index_header*>(data_);
+    auto slots = reinterpret_cast<const index_slot*>(header + 1);
+    uint64_t mask = header->num_slots - 1;
+    for (uint64_t i = first_slot(cmdhash), n = 0; n < header->num_slots; i++, n++) {
+        const index_slot& slot = slots[i & mask];
+        uint64_t offset = slot.offset.load(std::memory_order_acquire);
+        if (offset == 0)
+            return nullptr;
+        if (memcmp(slot.cmdhash, cmdhash.bytes, sizeof(slot.cmdhash)) != 0)
+            continue;
+        // appended after we mapped the file
+        if (offset + sizeof(record_header) > size_)
+            return nullptr;
+        auto record = reinterpret_cast<const record_header*>(data_ + offset);
+        if (record->size > size_ - offset)
+            return nullptr;
+        return record;
+    }
+    return nullptr;
+}
+
+void lookup_index::serve_if_valid(const digest_t& cmdhash, bool verbose) {
+    const record_header* record = find(cmdhash);
+    if (record == nullptr)
+        return;
+    const char* p = reinterpret_cast<const char*>(record + 1);
+    const char* end = reinterpret_cast<const char*>(record) + record->size;
+
+    for (uint32_t i = 0; i < record->num_deps; i++) {
+        dep_header d;
+        if (p + sizeof(d) > end)
+            return;
+        memcpy(&d, p, sizeof(d));
+        size_t len = padded(sizeof(d) + static_cast<size_t>(d.path_len) + 1 + d.members_len);
+        if (len > static_cast<size_t>(end - p))
+            return;
+        const char* path = p + sizeof(d);
+        const char* members = path + d.path_len + 1;
+        p += len;
+        if (path[d.path_len] != '\0')
+            return;
+
+        if (d.members_len > 0) {
+            digest_t digest, expected;
+            memcpy(expected.bytes, d.hash, sizeof(expected.bytes));
+            tree_digest(path, members, d.members_len, &digest);
+            if (digest != expected)
+                return;
+            continue;
+        }
+        file_fingerprint expected, current;
+        expected.valid = true;
+        expected.dev = d.dev;
+        expected.ino = d.ino;
+        expected.size = d.size;
+        expected.mtime_ns = d.mtime_ns;
+        expected.ctime_ns = d.ctime_ns;
+        if (!stat_fingerprint(path, &current) || current != expected)
+            return;
+    }
+
+    const char* outputs[2];
+    for (int i = 0; i < 2; i++) {
+        outputs[i] = p;
+        if (padded(record->output_sizes[i]) > static_cast<size_t>(end - p) ||
+            !codec_supported(record->codecs[i]))
+            return;
+        p += padded(record->output_sizes[i]);
+    }
+    // a full access log is for the database path to fold in
+    if (log_access(db_path_, record->cmdline_id) > ACCESS_LOG_MAX_SIZE)
+        return;
+    fflush(stdout);
+    if (!write_decoded_output(STDOUT_FILENO, record->codecs[0], outputs[0],
+                              record->output_sizes[0]) ||
+        !write_decoded_output(STDERR_FILENO, record->codecs[1], outputs[1],
+                              record->output_sizes[1])) {
+        error_msg_and_die("Corrupt output for entry %lld in the cache index",
+                          static_cast<long long>(record->cmdline_id));
+    }
+    if (verbose) {
+        printf("%s: Read from cache '%s' through its index\n", program_invocation_short_name,
+               db_path_.c_str());
+    }
+    exit(record->exit_status);
+}
+
+/* Open and lock the index file at *path*, making sure that it's still the
+   one at *path*, not one a rebuild has since renamed away.
+*/
+static int open_locked(const std::string& path) {
+    while (1) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+            return -1;
+        struct flock fl = {};
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = 0;
+        fl.l_len = 1;
+        struct stat locked, current;
+        while (fcntl(fd, F_OFD_SETLKW, &fl) < 0) {
+            if (errno != EINTR) {
+                close(fd);
+                return -1;
+            }
+        }
+        if (fstat(fd, &locked) == 0 && stat(path.c_str(), &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+bool lookup_index::append(const std::string& db_path, const index_entry& entry) {
+    int fd = open_locked(db_path + ".index");
+    if (fd < 0)
+        return true; // e.g. a read-only directory: no index, then
+
+    index_header header;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != INDEX_MAGIC || header.num_slots == 0 ||
+        table_size(header.num_slots) > static_cast<size_t>(statbuf.st_size) ||
+        !same_database(header, db_path)) {
+        close(fd);
+        return false;
+    }
+
+    size_t table_bytes = table_size(header.num_slots);
+    void* p = mmap(nullptr, table_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return true;
+    }
+    auto mapped_header = static_cast<index_header*>(p);
+    auto slots = reinterpret_cast<index_slot*>(mapped_header + 1);
+
+    index_slot* slot = nullptr;
+    uint64_t mask = header.num_slots - 1;
+    for (uint64_t i = first_slot(entry.cmdhash), n = 0; n < header.num_slots; i++, n++) {
+        index_slot* s = &slots[i & mask];
+        if (s->offset.load() == 0 ||
+            memcmp(s->cmdhash, entry.cmdhash.bytes, sizeof(s->cmdhash)) == 0) {
+            slot = s;
+            break;
+        }
+    }
+
+    std::string record = serialize(entry);
+    uint64_t end = statbuf.st_size;
+    uint64_t garbage = end - table_bytes - header.live_bytes;
+    bool fits = slot != nullptr &&
+                (slot->offset.load() != 0 || header.num_used + 1 <= header.num_slots / 2) &&
+                garbage <= std::max(INDEX_MIN_GARBAGE, header.live_bytes);
+    if (fits && pwrite(fd, record.data(), record.size(), end) ==
+                    static_cast<ssize_t>(record.size())) {
+        uint64_t old = slot->offset.load();
+        if (old == 0) {
+            memcpy(slot->cmdhash, entry.cmdhash.bytes, sizeof(slot->cmdhash));
+            mapped_header->num_used++;
+        } else {
+            record_header replaced;
+            if (pread(fd, &replaced, sizeof(replaced), old) == sizeof(replaced))
+                mapped_header->live_bytes -= replaced.size;
+        }
+        mapped_header->live_bytes += record.size();
+        // the record is complete before any reader can find it
+        slot->offset.store(end, std::memory_order_release);
+    }
+    munmap(p, table_bytes);
+    close(fd);
+    return fits;
+}
+
+bool lookup_index::contains(const std::string& db_path,
+                            const digest_t& cmdhash,
+                            int64_t cmdline_id) {
+    lookup_index index;
+    if (!index.open(db_path))
+        return false;
+    const record_header* record = index.find(cmdhash);
+    return record != nullptr && record->cmdline_id == cmdline_id;
+}
+
+void lookup_index::rebuild(const std::string& db_path,
+                           const std::function<void(std::vector<index_entry>*)>& load) {
+    int lock_fd = open_locked(db_path + ".index");
+    if (lock_fd < 0)
+        return;
+    std::vector<index_entry> entries;
+    load(&entries);
+    write_rebuilt(db_path, entries);
+    close(lock_fd);
+}
+
+void lookup_index::write_rebuilt(const std::string& db_path,
+                                 const std::vector<index_entry>& entries) {
+    uint64_t num_slots = INDEX_MIN_SLOTS;
+    while (num_slots < 4 * entries.size())
+        num_slots *= 2;
+
+    std::string table(table_size(num_slots), '\0');
+    auto header = reinterpret_cast<index_header*>(&table[0]);
+    auto slots = reinterpret_cast<index_slot*>(header + 1);
+    struct stat statbuf;
+    if (stat(db_path.c_str(), &statbuf) < 0)
+        return;
+    header->magic = INDEX_MAGIC;
+    header->db_dev = statbuf.st_dev;
+    header->db_ino = statbuf.st_ino;
+    header->num_slots = num_slots;
+
+    std::string records;
+    uint64_t mask = num_slots - 1;
+    for (auto const& entry : entries) {
+        uint64_t i = first_slot(entry.cmdhash);
+        while (slots[i & mask].offset.load() != 0)
+            i++;
+        index_slot& slot = slots[i & mask];
+        memcpy(slot.cmdhash, entry.cmdhash.bytes, sizeof(slot.cmdhash));
+        slot.offset.store(table.size() + records.size());
+        records += serialize(entry);
+        header->num_used++;
+    }
+    header->live_bytes = records.size();
+
+    // readers still using the old file keep it, and see a consistent one
+    std::string tmp = db_path + ".index." + std::to_string(getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return;
+    bool ok = true;
+    for (auto const* part : {&table, &records}) {
+        if (ok && write(fd, part->data(), part->size()) != static_cast<ssize_t>(part->size()))
+            ok = false;
+    }
+    if (close(fd) < 0 || !ok || rename(tmp.c_str(), (db_path + ".index").c_str()) < 0)
+        unlink(tmp.c_str());
+}
+
+}; // namespace cache_dash_h
@@ -0,0 +1,83 @@
+#pragma once
+#include "utils.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cache_dash_h {
+
+/* One entry as stored in the lookup index: everything a hit needs, so it
+   can be served without opening the database.
+*/
+struct index_dep {
+    std::string path;
+    file_fingerprint fingerprint; // a file: must still match
+    digest_t hash;                // a tree (see tree_digest): must still match
+    std::string members;
+};
+
+struct index_entry {
+    digest_t cmdhash;
+    int64_t cmdline_id{0};
+    int exit_status{0};
+    int codecs[2]{0, 0};
+    std::string outputs[2]; // stdout, stderr; as stored, i.e. still encoded
+    std::vector<index_dep> deps;
+};
+
+/* CACHE.index, a read-optimized copy of the newest entry for each command,
+   built from the database (which stays the source of truth): a fixed-size
+   hash table from cmdhash to the offset of a record, and the records
+   appended after it. A hit is an open, an mmap, a probe, a stat per
+   dependency and a write; anything the index can't vouch for (a missing
+   record, a changed fingerprint) falls back to the database.
+
+   Records are only ever appended, and slots only ever point at complete
+   records, so readers need no lock. Writers hold an OFD lock on the file,
+   and when it fills up replace it with a rebuilt one.
+*/
+class lookup_index {
+  public:
+    ~lookup_index();
+
+    // map CACHE.index read-only, if there is one
+    bool open(const std::string& db_path);
+
+    /* If the indexed entry for *cmdhash* is still valid, print its output
+       and exit with its status.
+    */
+    void serve_if_valid(const digest_t& cmdhash, bool verbose);
+
+    /* Add *entry* to the index of the cache at *db_path*, replacing what was
+       there for its cmdhash. Returns false if the index is full (or holds
+       too much that's been replaced since), and wants rebuilding.
+    */
+    static bool append(const std::string& db_path, const index_entry& entry);
+
+    // whether the index of the cache at *db_path* has *cmdline_id* for *cmdhash*
+    static bool contains(const std::string& db_path, const digest_t& cmdhash, int64_t cmdline_id);
+
+    /* Replace the index with one holding just the entries *load* fills in.
+       It's called with the index locked, so that an entry appended in the
+       meantime ends up in one or the other, not in the index being replaced.
+    */
+    static void rebuild(const std::string& db_path,
+                        const std::function<void(std::vector<index_entry>*)>& load);
+
+  private:
+    struct record_header;
+    static std::string serialize(const index_entry& entry);
+    static void write_rebuilt(const std::string& db_path, const std::vector<index_entry>& entries);
+    const record_header* find(const digest_t& cmdhash) const;
+
+    std::string db_path_;
+    int fd_{-1};
+    const char* data_{nullptr};
+    size_t size_{0};
+};
+
+}; // namespace cache_dash_h
@@ -0,0 +1,221 @@
+#include "preload.h"
+#include "error_prints.h"
+#include "tee.h"
+#include "utils.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace cache_dash_h {
+
+static const char PRELOAD_LIBRARY[] = "libcache-dash-h-preload.so";
+
+// the shim's pipe is moved up here, out of the way of programs that dup2()
+// onto the low fds
+static const int REPORT_FD_MIN = 200;
+
+/* The shim is installed next to the executable, or in ../lib */
+static std::string find_preload_library() {
+    std::string exe_dir = path::dirname(path::readlink("/proc/self/exe"));
+    for (auto const& dir : {exe_dir, exe_dir + "/../lib"}) {
+        std::string candidate = dir + "/" + PRELOAD_LIBRARY;
+        if (access(candidate.c_str(), R_OK) == 0)
+            return path::realpath(candidate);
+    }
+    return "";
+}
+
+/* Check that *fd* is a native ELF executable with a PT_INTERP header, i.e.
+   that it goes through the dynamic loader, which is what honors LD_PRELOAD.
+*/
+static bool is_dynamic_elf(int fd) {
+    Elf64_Ehdr ehdr;
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+        return false;
+    if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+        return false;
+
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr phdr;
+        off_t offset = ehdr.e_phoff + static_cast<off_t>(i) * ehdr.e_phentsize;
+        if (pread(fd, &phdr, sizeof(phdr), offset) != sizeof(phdr))
+            return false;
+        if (phdr.p_type == PT_INTERP)
+            return true;
+    }
+    return false;
+}
+
+/* Whether *program* would run with our shim loaded, following #! lines the
+   way the kernel does (and through "/usr/bin/env NAME"). setuid and setgid
+   programs ignore LD_PRELOAD, and static binaries have no loader to honor it.
+*/
+static bool program_supports_preload(const std::string& program, int depth) {
+    struct stat statbuf;
+    if (depth > 4 || stat(program.c_str(), &statbuf) < 0)
+        return false;
+    if (statbuf.st_mode & (S_ISUID | S_ISGID))
+        return false;
+
+    int fd = open(program.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char header[256];
+    ssize_t n = pread(fd, header, sizeof(header) - 1, 0);
+    if (n < 2 || header[0] != '#' || header[1] != '!') {
+        bool dynamic = n > 0 && is_dynamic_elf(fd);
+        close(fd);
+        return dynamic;
+    }
+    close(fd);
+
+    header[n] = '\0';
+    std::string line(header + 2, strcspn(header + 2, "\n"));
+    std::vector<std::string> words;
+    str::split_whitespace(line, [&](const std::string& w) { words.push_back(w); });
+    if (words.empty() || !program_supports_preload(words[0], depth + 1))
+        return false;
+
+    if (words.size() > 1 && path::basename(words[0]) == "env" && words[1][0] != '-') {
+        std::string target = find_in_path(words[1], /*allow_ENOENT=*/true);
+        return target.size() > 0 && program_supports_preload(target, depth + 1);
+    }
+    return true;
+}
+
+bool preload_tracer_supported(const std::vector<std::string>& cmd) {
+    return find_preload_library().size() > 0 && program_supports_preload(cmd[0], 0);
+}
+
+static void prepend_env(const char* name, const std::string& value) {
+    const char* old = getenv(name);
+    std::string joined = value;
+    if (old != NULL && old[0] != '\0')
+        joined += std::string(":") + old;
+    setenv(name, joined.c_str(), 1);
+}
+
+/* Fork and exec *cmd* with the shim in LD_PRELOAD and LD_AUDIT, and collect
+   the paths it reports until it exits. Same contract as
+   exec_and_record_opened_files.
+*/
+std::tuple<std::string, std::string, int>
+exec_and_record_opened_files_preload(std::vector<std::string>& cmd,
+                                     std::function<void(std::string const&)> open_callback) {
+    int exit_status = -1;
+    pid_t pid = 0;
+    std::string library = find_preload_library();
+
+    output_tee tee;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        perror_msg_and_die("Can't create pipe");
+    int report_fd = fcntl(fds[1], F_DUPFD_CLOEXEC, REPORT_FD_MIN);
+    if (report_fd < 0)
+        perror_msg_and_die("Can't dup pipe");
+    close(fds[1]);
+    struct stat pipe_stat;
+    if (fstat(fds[0], &pipe_stat) < 0)
+        perror_msg_and_die("Can't stat pipe");
+
+    if ((pid = fork()) == -1)
+        perror_msg_and_die("Can't fork");
+
+    if (pid == 0) {
+        // a copy of our caller: leave only through exec or _exit
+        try {
+            tee.redirect_child();
+
+            // the write end is inherited by everything the command runs
+            if (fcntl(report_fd, F_SETFD, 0) < 0)
+                perror_msg_and_die("Can't clear FD_CLOEXEC");
+            char env[128];
+            snprintf(env, sizeof(env), "%d:%d:%d:%lu", report_fd, static_cast<int>(getppid()),
+                     fds[0], static_cast<unsigned long>(pipe_stat.st_ino));
+            setenv("CACHEDASHH_PRELOAD_FD", env, 1);
+            prepend_env("LD_PRELOAD", library);
+            prepend_env("LD_AUDIT", library);
+
+            c_cmdline c_style(cmd);
+            execvp(c_style.argv[0], c_style.c_argv());
+            perror_msg_and_die("Can't exec '%s'", c_style.argv[0]);
+        } catch (...) {
+        }
+        _exit(EXIT_FAILURE);
+    }
+
+    close(report_fd);
+    tee.start();
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0)
+        perror_msg_and_die("Can't make pipe non-blocking");
+
+    char buffer[65536];
+    std::string pending;
+    // read what's in the pipe, returning false at EOF
+    auto read_reports = [&]() {
+        while (1) {
+            ssize_t nread = read(fds[0], buffer, sizeof(buffer));
+            if (nread < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN)
+                    return true;
+                perror_msg_and_die("Can't read from pipe");
+            }
+            if (nread == 0)
+                return false;
+            pending.append(buffer, nread);
+
+            // records are NUL-terminated paths
+            size_t start = 0, end;
+            while ((end = pending.find('\0', start)) != std::string::npos) {
+                std::string path = pending.substr(start, end - start);
+                if (path != library)
+                    open_callback(path);
+                start = end + 1;
+            }
+            pending.erase(0, start);
+        }
+    };
+
+    // whatever the command leaves in the background keeps the pipe open, so
+    // wait for the command itself. without pidfds (linux < 5.3, or built
+    // against older headers) we check on it every 10ms.
+#ifdef SYS_pidfd_open
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    int pidfd = -1;
+#endif
+    struct pollfd pfds[2] = {{fds[0], POLLIN, 0}, {pidfd, POLLIN, 0}};
+    int status;
+    while (1) {
+        pid_t reaped = waitpid(pid, &status, WNOHANG);
+        if (reaped < 0 && errno != EINTR)
+            perror_msg_and_die("Can't wait for child");
+        if (reaped == pid)
+            break;
+        if (poll(pfds, 2, pidfd >= 0 ? -1 : 10) < 0 && errno != EINTR)
+            perror_msg_and_die("Can't poll pipe");
+        if (pfds[0].revents != 0 && !read_reports())
+            pfds[0].fd = -1;
+    }
+    exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    // everything the command opened is in the pipe by now
+    if (pfds[0].fd >= 0)
+        read_reports();
+    if (pidfd >= 0)
+        close(pidfd);
+    close(fds[0]);
+
+    auto output = tee.finish();
+    return std::make_tuple(std::move(output.first), std::move(output.second), exit_status);
+}
+
+}; // namespace cache_dash_h
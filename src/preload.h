@@ -0,0 +1,15 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace cache_dash_h {
+
+bool preload_tracer_supported(const std::vector<std::string>& cmd);
+
+std::tuple<std::string, std::string, int>
+exec_and_record_opened_files_preload(std::vector<std::string>& cmd,
+                                     std::function<void(std::string const&)> open_callback);
+
+}; // namespace cache_dash_h
@@ -0,0 +1,305 @@
+/*
+ * LD_PRELOAD / LD_AUDIT shim for the preload tracer (see preload.cpp).
+ *
+ * Loaded into every process of the traced command, it interposes the libc
+ * functions that open files and streams the absolute path of every file
+ * opened for reading to cache-dash-h over a pipe, one NUL-terminated record
+ * per write(2). Records are at most PATH_MAX <= PIPE_BUF bytes, so writes
+ * from concurrent processes never interleave.
+ *
+ * The dynamic loader opens shared libraries without going through libc, so
+ * the same library is also loaded with LD_AUDIT and reports every object
+ * from la_objopen().
+ *
+ * chdir() doesn't need interposing: relative paths are resolved against the
+ * process's current directory at the time of the open.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* See feature_test_macros(7) */
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* "<fd>:<pid>:<reader fd>:<ino>", set by cache-dash-h. fd is the write end
+   of the pipe, pid and reader fd locate its read end in cache-dash-h, and
+   ino identifies the pipe itself. */
+#define PRELOAD_FD_ENV "CACHEDASHH_PRELOAD_FD"
+
+static int report_fd = -1;
+static pid_t reader_pid = 0;
+static int reader_fd = -1;
+static ino_t pipe_ino = 0;
+static int initialized = 0;
+
+static void init_report_fd(void) {
+    const char* env;
+    int fd, pid, rfd;
+    unsigned long ino;
+
+    if (initialized)
+        return;
+    initialized = 1;
+    env = getenv(PRELOAD_FD_ENV);
+    if (env == NULL || sscanf(env, "%d:%d:%d:%lu", &fd, &pid, &rfd, &ino) != 4)
+        return;
+    report_fd = fd;
+    reader_pid = pid;
+    reader_fd = rfd;
+    pipe_ino = ino;
+}
+
+/* Programs that close every fd above 2 before exec'ing a subprocess (e.g.
+   python's subprocess module) take our pipe with them, and the fd number may
+   since have been reused for something else entirely. So check that it's
+   still our pipe, and if not get a new write end through /proc. */
+static int get_report_fd(void) {
+    struct stat statbuf;
+    char path[64];
+    int fd;
+
+    init_report_fd();
+    if (pipe_ino == 0)
+        return -1;
+    if (report_fd >= 0 && fstat(report_fd, &statbuf) == 0 && S_ISFIFO(statbuf.st_mode) &&
+        statbuf.st_ino == pipe_ino)
+        return report_fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)reader_pid, reader_fd);
+    fd = (int)syscall(SYS_openat, AT_FDCWD, path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &statbuf) < 0 || statbuf.st_ino != pipe_ino) {
+        if (fd >= 0)
+            close(fd);
+        pipe_ino = 0;
+        return -1;
+    }
+    report_fd = fd;
+    return report_fd;
+}
+
+/* cache-dash-h stops reading once the command itself has exited, and what
+   the command left running in the background mustn't be killed by SIGPIPE
+   for opening a file after that. So SIGPIPE is blocked around the write,
+   and one raised by it is taken off the pending set again. */
+static void report_absolute(const char* path) {
+    size_t len = strlen(path) + 1;
+    int fd = get_report_fd();
+    sigset_t sigpipe, old_mask, pending;
+    struct timespec no_wait = {0, 0};
+    int was_pending;
+    ssize_t n;
+
+    if (fd < 0 || len > PIPE_BUF)
+        return;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &sigpipe, &old_mask);
+    sigpending(&pending);
+    was_pending = sigismember(&pending, SIGPIPE);
+    while ((n = write(fd, path, len)) < 0 && errno == EINTR)
+        ;
+    if (n < 0 && errno == EPIPE) {
+        if (!was_pending)
+            sigtimedwait(&sigpipe, NULL, &no_wait);
+        pipe_ino = 0;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/* Report *path* as opened relative to *dirfd*, if the open didn't fail with
+   ENOENT. Like the ptrace tracer, relative paths are resolved with realpath. */
+static void report(int dirfd, const char* path, int result) {
+    char joined[PATH_MAX * 2];
+    char resolved[PATH_MAX];
+    char base[PATH_MAX];
+    int saved_errno = errno;
+
+    if (path == NULL || (result < 0 && saved_errno == ENOENT))
+        return;
+    if (path[0] == '/') {
+        report_absolute(path);
+    } else {
+        if (dirfd == AT_FDCWD) {
+            if (getcwd(base, sizeof(base)) == NULL)
+                goto out;
+        } else {
+            char fdpath[64];
+            ssize_t n;
+            snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", dirfd);
+            n = readlink(fdpath, base, sizeof(base) - 1);
+            if (n < 0)
+                goto out;
+            base[n] = '\0';
+        }
+        snprintf(joined, sizeof(joined), "%s/%s", base, path);
+        if (realpath(joined, resolved) != NULL)
+            report_absolute(resolved);
+    }
+out:
+    errno = saved_errno;
+}
+
+static int opened_for_reading(int flags) {
+    return !(flags & O_WRONLY) && !(flags & O_DIRECTORY);
+}
+
+#define REAL(name)                                                                                 \
+    static __typeof__(name)* real_##name;                                                          \
+    if (real_##name == NULL)                                                                       \
+        real_##name = (__typeof__(name)*)dlsym(RTLD_NEXT, #name);
+
+#define OPEN_MODE(flags, mode)                                                                     \
+    do {                                                                                           \
+        if ((flags) & (O_CREAT | O_TMPFILE)) {                                                     \
+            va_list ap;                                                                            \
+            va_start(ap, flags);                                                                   \
+            mode = va_arg(ap, mode_t);                                                             \
+            va_end(ap);                                                                            \
+        }                                                                                          \
+    } while (0)
+
+EXPORT int open(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    int fd;
+    REAL(open);
+    OPEN_MODE(flags, mode);
+    fd = real_open(path, flags, mode);
+    if (opened_for_reading(flags))
+        report(AT_FDCWD, path, fd);
+    return fd;
+}
+
+EXPORT int open64(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    int fd;
+    REAL(open64);
+    OPEN_MODE(flags, mode);
+    fd = real_open64(path, flags, mode);
+    if (opened_for_reading(flags))
+        report(AT_FDCWD, path, fd);
+    return fd;
+}
+
+EXPORT int openat(int dirfd, const char* path, int flags, ...) {
+    mode_t mode = 0;
+    int fd;
+    REAL(openat);
+    OPEN_MODE(flags, mode);
+    fd = real_openat(dirfd, path, flags, mode);
+    if (opened_for_reading(flags))
+        report(dirfd, path, fd);
+    return fd;
+}
+
+EXPORT int openat64(int dirfd, const char* path, int flags, ...) {
+    mode_t mode = 0;
+    int fd;
+    REAL(openat64);
+    OPEN_MODE(flags, mode);
+    fd = real_openat64(dirfd, path, flags, mode);
+    if (opened_for_reading(flags))
+        report(dirfd, path, fd);
+    return fd;
+}
+
+/* _FORTIFY_SOURCE builds call these instead of open/openat */
+int __open_2(const char* path, int flags);
+int __open64_2(const char* path, int flags);
+int __openat_2(int dirfd, const char* path, int flags);
+int __openat64_2(int dirfd, const char* path, int flags);
+
+EXPORT int __open_2(const char* path, int flags) {
+    int fd;
+    REAL(__open_2);
+    fd = real___open_2(path, flags);
+    if (opened_for_reading(flags))
+        report(AT_FDCWD, path, fd);
+    return fd;
+}
+
+EXPORT int __open64_2(const char* path, int flags) {
+    int fd;
+    REAL(__open64_2);
+    fd = real___open64_2(path, flags);
+    if (opened_for_reading(flags))
+        report(AT_FDCWD, path, fd);
+    return fd;
+}
+
+EXPORT int __openat_2(int dirfd, const char* path, int flags) {
+    int fd;
+    REAL(__openat_2);
+    fd = real___openat_2(dirfd, path, flags);
+    if (opened_for_reading(flags))
+        report(dirfd, path, fd);
+    return fd;
+}
+
+EXPORT int __openat64_2(int dirfd, const char* path, int flags) {
+    int fd;
+    REAL(__openat64_2);
+    fd = real___openat64_2(dirfd, path, flags);
+    if (opened_for_reading(flags))
+        report(dirfd, path, fd);
+    return fd;
+}
+
+/* "r", "r+", "w+" and "a+" read; "w" and "a" are write-only */
+static int fopen_for_reading(const char* mode) {
+    return mode != NULL && (mode[0] == 'r' || strchr(mode, '+') != NULL);
+}
+
+EXPORT FILE* fopen(const char* path, const char* mode) {
+    FILE* f;
+    REAL(fopen);
+    f = real_fopen(path, mode);
+    if (fopen_for_reading(mode))
+        report(AT_FDCWD, path, f == NULL ? -1 : 0);
+    return f;
+}
+
+EXPORT FILE* fopen64(const char* path, const char* mode) {
+    FILE* f;
+    REAL(fopen64);
+    f = real_fopen64(path, mode);
+    if (fopen_for_reading(mode))
+        report(AT_FDCWD, path, f == NULL ? -1 : 0);
+    return f;
+}
+
+EXPORT FILE* freopen(const char* path, const char* mode, FILE* stream) {
+    FILE* f;
+    REAL(freopen);
+    f = real_freopen(path, mode, stream);
+    if (fopen_for_reading(mode))
+        report(AT_FDCWD, path, f == NULL ? -1 : 0);
+    return f;
+}
+
+/* rtld-audit(7) interface, active when loaded through LD_AUDIT */
+
+EXPORT unsigned int la_version(unsigned int version) {
+    return version < LAV_CURRENT ? version : LAV_CURRENT;
+}
+
+EXPORT unsigned int la_objopen(struct link_map* map, Lmid_t lmid, uintptr_t* cookie) {
+    (void)lmid;
+    (void)cookie;
+    // the main program has an empty name and the vDSO a bare one
+    if (map->l_name != NULL && map->l_name[0] == '/')
+        report_absolute(map->l_name);
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include "server.h"
+#include "codec.h"
+#include "database.h"
+#include "error_prints.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cache_dash_h {
+
+static const uint32_t SERVER_MAGIC = 0x63646873; // "cdhs"
+// an argv bigger than this isn't a command line
+static const uint32_t MAX_REQUEST_SIZE = 4 << 20;
+// nor can an output bigger than this come out of SQLite (SQLITE_MAX_LENGTH)
+static const uint64_t MAX_OUTPUT_SIZE = 1000000000;
+
+/* A request is this header, then *argc* NUL-terminated arguments taking
+   *size* bytes. A reply is a reply_header, then the two outputs, as stored
+   (i.e. still encoded), if it's a hit.
+*/
+struct request_header {
+    uint32_t magic;
+    int32_t length;
+    uint32_t argc;
+    uint32_t size;
+};
+
+struct reply_header {
+    uint32_t magic;
+    uint32_t hit;
+    int32_t exit_status;
+    int32_t codecs[2];
+    uint64_t output_sizes[2];
+};
+
+static bool socket_address(const std::string& db_path, struct sockaddr_un* addr) {
+    std::string path = db_path + ".sock";
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path))
+        return false;
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Unlike write_all, a client that went away isn't fatal.
+static bool send_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t len) {
+    char* p = static_cast<char*>(data);
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// neither side waits on a peer that hangs for longer than this
+static void set_timeout(int fd, int seconds) {
+    struct timeval tv = {seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static char socket_path[sizeof(sockaddr_un::sun_path)];
+
+static void remove_socket_and_exit(int) {
+    unlink(socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+class server {
+  public:
+    server(Database& db, const std::string& db_path, bool verbose)
+        : db_(db)
+        , db_path_(db_path)
+        , verbose_(verbose) {}
+
+    void run() {
+        struct sockaddr_un addr;
+        if (!socket_address(db_path_, &addr))
+            error_msg_and_die("Path of '%s.sock' is too long for a socket", db_path_.c_str());
+        if (stat(db_path_.c_str(), &db_stat_) < 0)
+            perror_msg_and_die("Can't stat '%s'", db_path_.c_str());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            perror_msg_and_die("Can't create socket");
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0)
+            error_msg_and_die("'%s' is already being served", db_path_.c_str());
+        // nobody is listening on one that's left over
+        unlink(addr.sun_path);
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+            perror_msg_and_die("Can't bind to '%s'", addr.sun_path);
+        if (listen(fd, SOMAXCONN) < 0)
+            perror_msg_and_die("Can't listen on '%s'", addr.sun_path);
+
+        memcpy(socket_path, addr.sun_path, sizeof(socket_path));
+        signal(SIGINT, remove_socket_and_exit);
+        signal(SIGTERM, remove_socket_and_exit);
+        signal(SIGHUP, remove_socket_and_exit);
+        if (verbose_) {
+            printf("%s: Serving '%s' on '%s'\n", program_invocation_short_name,
+                   db_path_.c_str(), socket_path);
+            fflush(stdout);
+        }
+
+        while (1) {
+            int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                perror_msg_and_die("Can't accept connection");
+            }
+            set_timeout(client, 1);
+            Answer(client);
+            close(client);
+            fflush(stdout);
+        }
+    }
+
+  private:
+    void Answer(int client) {
+        request_header request;
+        if (!recv_all(client, &request, sizeof(request)) || request.magic != SERVER_MAGIC ||
+            request.size > MAX_REQUEST_SIZE)
+            return;
+        args_.resize(request.size);
+        if (!recv_all(client, &args_[0], request.size))
+            return;
+        cmd_.clear();
+        size_t start = 0, end;
+        while (cmd_.size() < request.argc && (end = args_.find('\0', start)) != std::string::npos) {
+            cmd_.push_back(args_.substr(start, end - start));
+            start = end + 1;
+        }
+        if (cmd_.size() != request.argc || cmd_.empty())
+            return;
+
+        // one deleted and created again is a different cache, which this
+        // connection can't see
+        struct stat current;
+        if (stat(db_path_.c_str(), &current) < 0 || current.st_dev != db_stat_.st_dev ||
+            current.st_ino != db_stat_.st_ino) {
+            if (verbose_)
+                printf("%s: '%s' was replaced, exiting\n", program_invocation_short_name,
+                       db_path_.c_str());
+            fflush(stdout);
+            remove_socket_and_exit(0);
+        }
+
+        reply_header reply = {SERVER_MAGIC, 0, 0, {0, 0}, {0, 0}};
+        index_entry entry;
+        try {
+            if (db_.Lookup(hash_command_line(request.length, cmd_), &entry)) {
+                reply.hit = 1;
+                reply.exit_status = entry.exit_status;
+                for (int i = 0; i < 2; i++) {
+                    reply.codecs[i] = entry.codecs[i];
+                    reply.output_sizes[i] = entry.outputs[i].size();
+                }
+                if (verbose_)
+                    printf("%s: Served entry %lld for '%s'\n", program_invocation_short_name,
+                           static_cast<long long>(entry.cmdline_id), cmd_[0].c_str());
+            }
+        } catch (const SQLite::Exception& e) {
+            // the client can look it up itself
+            if (verbose_)
+                printf("%s: Can't read from cache: %s\n", program_invocation_short_name,
+                       e.what());
+            reply.hit = 0;
+        }
+        if (!send_all(client, &reply, sizeof(reply)) || !reply.hit)
+            return;
+        for (int i = 0; i < 2; i++) {
+            if (!send_all(client, entry.outputs[i].data(), entry.outputs[i].size()))
+                return;
+        }
+    }
+
+    Database& db_;
+    std::string db_path_;
+    bool verbose_;
+    struct stat db_stat_;
+    // reused between requests
+    std::string args_;
+    std::vector<std::string> cmd_;
+};
+
+void run_server(Database& db, const std::string& db_path, bool verbose) {
+    server s(db, db_path, verbose);
+    s.run();
+}
+
+void print_from_server_if_possible(const std::string& db_path,
+                                   int length,
+                                   const std::vector<std::string>& cmd,
+                                   bool verbose) {
+    struct sockaddr_un addr;
+    if (!socket_address(db_path, &addr) || access(addr.sun_path, F_OK) < 0)
+        return;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return;
+    }
+    set_timeout(fd, 5);
+
+    std::string args;
+    for (auto const& arg : cmd) {
+        args += arg;
+        args.push_back('\0');
+    }
+    request_header request = {SERVER_MAGIC, length, static_cast<uint32_t>(cmd.size()),
+                              static_cast<uint32_t>(args.size())};
+    reply_header reply;
+    // the whole reply is in before anything is printed, so that whatever
+    // goes wrong we can still run the command ourselves
+    std::string outputs[2];
+    bool hit = send_all(fd, &request, sizeof(request)) &&
+               send_all(fd, args.data(), args.size()) &&
+               recv_all(fd, &reply, sizeof(reply)) && reply.magic == SERVER_MAGIC &&
+               reply.hit && codec_supported(reply.codecs[0]) && codec_supported(reply.codecs[1]) &&
+               reply.output_sizes[0] <= MAX_OUTPUT_SIZE && reply.output_sizes[1] <= MAX_OUTPUT_SIZE;
+    for (int i = 0; hit && i < 2; i++) {
+        outputs[i].resize(reply.output_sizes[i]);
+        hit = reply.output_sizes[i] == 0 ||
+              recv_all(fd, &outputs[i][0], reply.output_sizes[i]);
+    }
+    close(fd);
+    if (!hit)
+        return;
+
+    fflush(stdout);
+    if (!write_decoded_output(STDOUT_FILENO, reply.codecs[0], outputs[0].data(),
+                              outputs[0].size()) ||
+        !write_decoded_output(STDERR_FILENO, reply.codecs[1], outputs[1].data(),
+                              outputs[1].size())) {
+        error_msg_and_die("Corrupt output from the cache server");
+    }
+    if (verbose) {
+        printf("%s: Read from cache '%s' through its server\n", program_invocation_short_name,
+               db_path.c_str());
+    }
+    exit(reply.exit_status);
+}
+
+}; // namespace cache_dash_h
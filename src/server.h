@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace cache_dash_h {
+
+struct Database;
+
+/* `cache-dash-h --serve`: answer lookups for the cache at *db_path* over
+   the Unix socket CACHE.sock, from one long-lived connection to *db*, so a
+   hit costs a round trip rather than opening the database, checking its
+   schema and preparing statements all over again. Misses are left to the
+   client, which traces the command itself. Runs until killed, or until the
+   cache file is replaced by another.
+*/
+void run_server(Database& db, const std::string& db_path, bool verbose);
+
+/* The client's side: if a server is running for the cache at *db_path* and
+   has an entry for *cmd* (hashed with *length*, as hash_command_line does),
+   print its output and exit with its status. Returns on a miss, or if
+   there's no server to ask.
+*/
+void print_from_server_if_possible(const std::string& db_path,
+                                   int length,
+                                   const std::vector<std::string>& cmd,
+                                   bool verbose);
+
+}; // namespace cache_dash_h
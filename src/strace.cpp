@@ -1,22 +1,35 @@
 #include "strace.h"
 #include "error_prints.h"
+#include "tee.h"
 #include "utils.h"
 
 #include <elf.h>
 #include <fcntl.h>
+#include <fstream>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <map>
+#include <stdexcept>
+#include <signal.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
 #include <sys/user.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <utility>
 
 #if defined(__x86_64__) || defined(_M_X64)
 #define X64 1
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_X86_64
 #elif defined(__arm64__) || defined(__aarch64__)
 #define A64 1
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_AARCH64
 #else
 #error "Unknown architecture"
 #endif
@@ -24,7 +37,6 @@
 namespace cache_dash_h {
 
 typedef unsigned long kernel_ulong_t;
-typedef std::pair<kernel_ulong_t, std::string> syscall_record;
 
 /* Read *len* bytes from remote address *raddr* in child process with pid *pid*
    and copy them to local address *laddr*
@@ -110,16 +122,53 @@ struct syscall_args_t {
     const unsigned long long returnval;
 };
 
-void process_chdir(syscall_args_t& call, std::vector<syscall_record>& records) {
-    char path[PATH_MAX];
-    int num_bytes = umovestr(call.pid, call.p0, sizeof(path), path);
-    if (num_bytes <= 0)
-        error_msg_and_die("failed to read memory");
-    records.push_back({call.num, std::string(path)});
+/* Per-task state: one of these for every thread and process in the traced
+   tree, keyed by tid.
+*/
+struct tracee_t {
+    pid_t tgid;
+    bool in_syscall;
+};
+
+struct trace_state_t {
+    std::map<pid_t, tracee_t> tasks;
+    // the working directory of each traced process, keyed by tgid, since all
+    // of a process's threads share it
+    std::map<pid_t, std::string> cwds;
+    std::function<void(std::string const&)> open_callback;
+};
+
+/* Resolve the path argument of an open/openat in *call*, relative to the
+   directory *dirfd* of the calling task, the way the kernel would.
+*/
+std::string resolve_path(syscall_args_t& call,
+                         int dirfd,
+                         const std::string& path,
+                         trace_state_t& state) {
+    if (path::isabs(path))
+        return path;
+    std::string base;
+    if (dirfd == AT_FDCWD) {
+        base = state.cwds[state.tasks[call.pid].tgid];
+    } else {
+        base = path::readlink("/proc/" + std::to_string(call.pid) + "/fd/" +
+                              std::to_string(dirfd));
+    }
+    return path::realpath(base + "/" + path);
+}
+
+void process_chdir(syscall_args_t& call, trace_state_t& state) {
+    if (call.returnval != 0) {
+        return;
+    }
+    // rather than redo the path resolution for chdir/fchdir, just ask the
+    // kernel where the process ended up
+    state.cwds[state.tasks[call.pid].tgid] =
+        path::readlink("/proc/" + std::to_string(call.pid) + "/cwd");
     return;
 }
 
-void process_openat(syscall_args_t& call, std::vector<syscall_record>& records) {
+void process_openat(syscall_args_t& call, trace_state_t& state) {
     if (call.p2 & O_DIRECTORY) {
         // if openat was passed with O_DIRECTORY
         // then it's not opening a file
@@ -128,7 +177,7 @@ void process_openat(syscall_args_t& call, std::vector<syscall_record>& records)
     if (call.p2 & O_WRONLY) {
         return;
     }
-    if ((-call.returnval) & ENOENT) {
+    if (static_cast<long long>(call.returnval) == -ENOENT) {
         return;
     }
 
@@ -136,15 +185,15 @@ void process_openat(syscall_args_t& call, std::vector<syscall_record>& records)
     int num_bytes = umovestr(call.pid, call.p1, sizeof(path), path);
     if (num_bytes <= 0)
         error_msg_and_die("failed to read memory");
-    records.push_back({call.num, std::string(path)});
+    state.open_callback(resolve_path(call, static_cast<int>(call.p0), path, state));
     return;
 }
 
-void process_open(syscall_args_t& call, std::vector<syscall_record>& records) {
+void process_open(syscall_args_t& call, trace_state_t& state) {
     if (call.p1 & O_WRONLY) {
         return;
     }
-    if (-call.returnval & ENOENT) {
+    if (static_cast<long long>(call.returnval) == -ENOENT) {
         return;
     }
 
@@ -152,126 +201,407 @@ void process_open(syscall_args_t& call, std::vector<syscall_record>& records) {
     int num_bytes = umovestr(call.pid, call.p0, sizeof(path), path);
     if (num_bytes <= 0)
         error_msg_and_die("failed to read memory");
-    records.push_back({call.num, std::string(path)});
+    state.open_callback(resolve_path(call, AT_FDCWD, path, state));
     return;
 }
 
-int trace_child(pid_t pid, int* exit_status, std::vector<syscall_record>& records) {
-    int status;
+/* The only syscalls whose arguments we look at. In seccomp mode every other
+   syscall runs without stopping the tracee.
+*/
+static const unsigned int traced_syscalls[] = {
+    SYS_chdir,
+    SYS_fchdir,
+    SYS_openat,
+#if defined(SYS_open)
+    SYS_open,
+#endif
+};
+
+/* Before linux 4.8 the seccomp stop came before the syscall-entry-stop, which
+   makes it awkward to find the matching syscall-exit-stop. Rather than
+   handle both orderings we just fall back to PTRACE_SYSCALL on those kernels.
+*/
+static bool kernel_supports_seccomp_tracing() {
+    struct utsname u;
+    int major = 0, minor = 0;
+    if (uname(&u) < 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    return (major > 4) || (major == 4 && minor >= 8);
+}
+
+/* Install a seccomp filter in the calling process that hands the traced
+   syscalls to the tracer with SECCOMP_RET_TRACE and allows everything else.
+   The filter is inherited across execve and fork, and can't be removed.
+
+   Without a tracer the traced syscalls fail with ENOSYS, so a filtered
+   process must never outlive its tracer. The tracer sees to that from both
+   ends: it keeps resuming filtered tasks until the last of them has exited
+   (see trace_child), it keeps out of the way of the signals meant for the
+   command (see run_tracer), and PTRACE_O_EXITKILL takes the tasks with it
+   if it's killed anyway.
+*/
+static bool install_seccomp_filter() {
+    const size_t n = sizeof(traced_syscalls) / sizeof(traced_syscalls[0]);
+    std::vector<struct sock_filter> filter{
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_NATIVE, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    };
+    for (size_t i = 0; i < n; i++) {
+        // jump to the RET_TRACE at the end, or fall through to the next test
+        filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, traced_syscalls[i],
+                                  static_cast<unsigned char>(n - i), 0));
+    }
+    filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+    filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE));
+
+    struct sock_fprog prog;
+    prog.len = filter.size();
+    prog.filter = filter.data();
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+        return false;
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) == 0;
+}
+
+/* Read an integer field like "Tgid:" from /proc/pid/status, or -1 */
+static int proc_status_field(pid_t pid, const char* field) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (str::startswith(line, field))
+            return atoi(line.c_str() + strlen(field));
+    }
+    return -1;
+}
+
+/* Check whether the stopped child *pid* actually ended up with a seccomp
+   filter installed (the "Seccomp:" field of /proc/pid/status is 2).
+*/
+static bool has_seccomp_filter(pid_t pid) {
+    return proc_status_field(pid, "Seccomp:") == SECCOMP_MODE_FILTER;
+}
+
+/* Start tracking a task we haven't seen before. Threads join the cwd of
+   their process; a new process starts from its own current directory, which
+   is still the one inherited from its parent since it hasn't run yet.
+*/
+static tracee_t& add_tracee(pid_t tid, trace_state_t& state) {
+    pid_t tgid = proc_status_field(tid, "Tgid:");
+    if (tgid <= 0)
+        tgid = tid;
+    if (state.cwds.find(tgid) == state.cwds.end())
+        state.cwds[tgid] = path::readlink("/proc/" + std::to_string(tid) + "/cwd");
+    tracee_t& t = state.tasks[tid];
+    t.tgid = tgid;
+    t.in_syscall = false;
+    return t;
+}
+
+void process_syscall_exit(pid_t pid, trace_state_t& state) {
     struct iovec iov;
     struct user_regs_struct regs;
-    bool start = true;
 
+    iov.iov_base = &regs;
+    iov.iov_len = sizeof(regs);
+    if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) == -1) {
+        error_msg_and_die("ptrace failed to get registers");
+    }
+    syscall_args_t syscall(pid, regs);
+
+    switch (syscall.num) {
+    case SYS_chdir:
+    case SYS_fchdir:
+        process_chdir(syscall, state);
+        break;
+    case SYS_openat:
+        process_openat(syscall, state);
+        break;
+#if defined(SYS_open)
+    case SYS_open:
+        process_open(syscall, state);
+        break;
+#endif
+    }
+}
+
+/* Trace the child *pid*, which has just stopped itself with SIGSTOP, and
+   everything it forks or clones. Each traced open is reported to
+   *open_callback* as an absolute path, resolved against the working
+   directory of the process that made it, and the child's exit status to
+   *exit_callback* once it has exited.
+
+   In seccomp mode the tasks only stop for the syscalls in traced_syscalls:
+   we get a PTRACE_EVENT_SECCOMP stop at entry, and then PTRACE_SYSCALL once
+   to see the return value at the syscall-exit-stop. Otherwise they stop at
+   entry and exit of every syscall.
+
+   Descendants still running when the child exits are released rather than
+   traced any further: without a seccomp filter each is detached at its next
+   stop. A filtered syscall fails with ENOSYS when nobody is tracing it
+   though, so those are only ever resumed, and this returns once they have
+   all exited.
+*/
+static void trace_child(pid_t pid,
+                        std::function<void(std::string const&)> open_callback,
+                        std::function<void(int)> exit_callback) {
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0)
+        perror_msg_and_die("Can't wait for child");
+    if (!WIFSTOPPED(status))
+        error_msg_and_die("Child didn't stop before exec");
+
+    bool seccomp = has_seccomp_filter(pid);
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL |
+                   PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE;
+    if (seccomp)
+        options |= PTRACE_O_TRACESECCOMP;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, options) < 0)
+        perror_msg_and_die("Can't set ptrace options");
+
+    trace_state_t state;
+    state.open_callback = open_callback;
+    add_tracee(pid, state);
+    bool released = false;
+
+    auto restart = [&](pid_t tid, int sig) {
+        auto request = (seccomp && !state.tasks[tid].in_syscall) ? PTRACE_CONT : PTRACE_SYSCALL;
+        // ESRCH means the task was killed while stopped; waitpid will tell us
+        if (ptrace(request, tid, NULL, sig) < 0 && errno != ESRCH) {
+            perror_msg_and_die("Can't trace\n");
+        }
+    };
+
+    restart(pid, 0);
     while (1) {
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) {
-            *exit_status = WEXITSTATUS(status);
-            return -1;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ECHILD)
+                return;
+            perror_msg_and_die("Can't wait for child");
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) {
+                exit_callback(WIFEXITED(status) ? WEXITSTATUS(status)
+                                                : 128 + WTERMSIG(status));
+                released = true;
+            }
+            state.tasks.erase(tid);
+            continue;
         }
+        if (!WIFSTOPPED(status))
+            continue;
 
-        iov.iov_base = &regs;
-        iov.iov_len = sizeof(regs);
-        if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) == -1) {
-            error_msg_and_die("ptrace failed to get registers");
+        int event = status >> 16;
+        int sig = WSTOPSIG(status);
+        if (released) {
+            // pass on signals, swallow the SIGSTOP new tasks start with, and
+            // leave the syscall alone
+            bool new_task = state.tasks.find(tid) == state.tasks.end();
+            if (event != 0 || sig == (SIGTRAP | 0x80) || (new_task && sig == SIGSTOP))
+                sig = 0;
+            if (seccomp) {
+                state.tasks[tid].in_syscall = false;
+                restart(tid, sig);
+            } else {
+                ptrace(PTRACE_DETACH, tid, NULL, sig);
+                state.tasks.erase(tid);
+            }
+            continue;
         }
-        syscall_args_t syscall(pid, regs);
-
-        switch (syscall.num) {
-        case SYS_chdir:
-            if ((start = !start) == true)
-                process_chdir(syscall, records);
-            break;
-        case SYS_openat:
-            if ((start = !start) == true)
-                process_openat(syscall, records);
-            break;
-#if defined(SYS_open)
-        case SYS_open:
-            if ((start = !start) == true)
-                process_open(syscall, records);
-            break;
-#endif
+        if (state.tasks.find(tid) == state.tasks.end()) {
+            // a newly auto-attached task, which starts with a SIGSTOP. this
+            // can arrive before or after the PTRACE_EVENT_* of its parent.
+            add_tracee(tid, state);
+            if (sig == SIGSTOP && event == 0) {
+                restart(tid, 0);
+                continue;
+            }
+        }
+        tracee_t& tracee = state.tasks[tid];
+
+        if (event == PTRACE_EVENT_SECCOMP) {
+            tracee.in_syscall = true;
+            sig = 0;
+        } else if (event == PTRACE_EVENT_EXEC) {
+            // a non-leader thread that execs takes over the leader's tid, and
+            // the old tid disappears without an exit notification
+            unsigned long former_tid;
+            if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &former_tid) == 0 &&
+                static_cast<pid_t>(former_tid) != tid) {
+                tracee.in_syscall = state.tasks[former_tid].in_syscall;
+                state.tasks.erase(former_tid);
+            }
+            sig = 0;
+        } else if (event != 0) {
+            // PTRACE_EVENT_FORK and friends, the new task shows up on its own
+            sig = 0;
+        } else if (sig == (SIGTRAP | 0x80)) {
+            tracee.in_syscall = !tracee.in_syscall;
+            if (!tracee.in_syscall)
+                process_syscall_exit(tid, state);
+            sig = 0;
         }
+        // otherwise it's a signal-delivery-stop, and the signal is passed on
+        restart(tid, sig);
+    }
+}
 
-        if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0) {
-            perror_msg_and_die("Can't trace\n");
+/* The tracer reports to cache-dash-h over a pipe, one NUL-terminated record
+   at a time: 'o' and a path for each open, then 'x' and the exit status.
+*/
+static bool send_record(int fd, char type, const std::string& data) {
+    std::string record = type + data;
+    const char* p = record.c_str();
+    size_t len = record.size() + 1;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        p += n;
+        len -= n;
     }
+    return true;
 }
 
-/* Fork and exec a child process, and return the stdout of the child process
-   as well as the list of all of the files it opened.
+/* Run in the tracer process: fork and exec *cmd* under ptrace and report
+   what it does on *report_fd*. Never returns.
 */
-std::tuple<std::string, std::string, int>
-exec_and_record_opened_files(std::vector<std::string>& cmd,
-                             std::function<void(std::string const&)> open_callback) {
-    int exit_status = -1;
-    pid_t pid = 0;
-    std::string curdir = path::getcwd();
-
-    char stdout_fn[] = "/tmp/cache-dash-h-stdout-XXXXXX";
-    char stderr_fn[] = "/tmp/cache-dash-h-stderr-XXXXXX";
-    int stdout_fd = mkstemp(stdout_fn);
-    int stderr_fd = mkstemp(stderr_fn);
-    if (unlink(stdout_fn) < 0)
-        perror_msg_and_die("Can't unlink");
-    if (unlink(stderr_fn) < 0)
-        perror_msg_and_die("Can't unlink");
-
-    if (stdout_fd == -1)
-        perror_msg_and_die("Can't open tempfile");
-    if (stderr_fd == -1)
-        perror_msg_and_die("Can't open tempfile");
-
-    if ((pid = fork()) == -1)
+[[noreturn]] static void run_tracer(std::vector<std::string>& cmd,
+                                    output_tee& tee,
+                                    int report_fd) {
+    // once the command has exited nobody may be reading the reports
+    struct sigaction ignore = {}, old_sigpipe;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old_sigpipe);
+
+    bool use_seccomp = kernel_supports_seccomp_tracing();
+    pid_t pid = fork();
+    if (pid == -1)
         perror_msg_and_die("Can't fork");
 
     if (pid == 0) {
-        dup2(stdout_fd, STDOUT_FILENO);
-        dup2(stderr_fd, STDERR_FILENO);
-        close(stdout_fd);
-        close(stderr_fd);
+        tee.redirect_child();
+        sigaction(SIGPIPE, &old_sigpipe, nullptr);
 
         c_cmdline c_style(cmd);
         ptrace(PTRACE_TRACEME);
+        if (use_seccomp) {
+            // if this fails the tracer sees no filter in /proc and falls
+            // back to stopping on every syscall
+            install_seccomp_filter();
+        }
         kill(getpid(), SIGSTOP);
         execvp(c_style.argv[0], c_style.c_argv());
         perror_msg_and_die("Can't exec '%s'", c_style.argv[0]);
+    }
 
-    } else {
-        std::vector<syscall_record> records;
-        trace_child(pid, &exit_status, records);
-        for (auto const& r : records) {
-            kernel_ulong_t syscall_num = r.first;
-            const std::string& syscall_path = r.second;
-            if (syscall_num == SYS_chdir) {
-                if (path::isabs(syscall_path)) {
-                    curdir = syscall_path;
-                } else {
-                    curdir = path::realpath(curdir + "/" + syscall_path);
-                }
-            } else {
-                // assert(syscall_num == SYS_open || syscall_num == SYS_openat);
-                if (path::isabs(syscall_path)) {
-                    open_callback(syscall_path);
-                } else {
-                    open_callback(path::realpath(curdir + "/" + syscall_path));
-                }
-            }
+    // we may outlive the command, so let go of everything whoever runs
+    // cache-dash-h could be waiting on. stderr only once there's nothing
+    // left to complain about.
+    tee.close_pipes();
+    // a process group of our own, so that ^C, a hangup or "kill %1" reach
+    // the command but not us
+    setpgid(0, 0);
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (devnull < 0 || dup2(devnull, STDIN_FILENO) < 0 || dup2(devnull, STDOUT_FILENO) < 0)
+        perror_msg_and_die("Can't open /dev/null");
+    trace_child(
+        pid, [&](std::string const& path) { send_record(report_fd, 'o', path); },
+        [&](int exit_status) {
+            send_record(report_fd, 'x', std::to_string(exit_status));
+            close(report_fd);
+            dup2(devnull, STDERR_FILENO);
+        });
+    _exit(0);
+}
+
+/* Fork and exec a child process, passing its output through as it runs,
+   and return its stdout, stderr and exit status. Every file it opens is
+   reported to *open_callback*. Throws std::runtime_error if it can't be
+   traced (e.g. ptrace isn't allowed).
+
+   The tracing is done by a process of its own, which nobody waits for: it
+   reports the child's exit status as soon as it has one, and then stays
+   around to see off whatever the child left running in the background.
+*/
+std::tuple<std::string, std::string, int>
+exec_and_record_opened_files(std::vector<std::string>& cmd,
+                             std::function<void(std::string const&)> open_callback) {
+    int exit_status = -1;
+    output_tee tee;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        perror_msg_and_die("Can't create pipe");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        perror_msg_and_die("Can't fork");
+    if (pid == 0) {
+        // this is a copy of whoever called us (maybe a program using
+        // libcachedashh), so only ever leave through _exit
+        try {
+            // fork again so the tracer is reparented away from us
+            close(fds[0]);
+            pid_t tracer = fork();
+            if (tracer == -1)
+                perror_msg_and_die("Can't fork");
+            if (tracer != 0)
+                _exit(0);
+            run_tracer(cmd, tee, fds[1]);
+        } catch (...) {
         }
+        _exit(EXIT_FAILURE);
     }
 
-    char buffer[4096];
-    std::string stdout_, stderr_;
-    lseek(stdout_fd, 0, SEEK_SET);
-    while (int nread = read(stdout_fd, buffer, sizeof(buffer))) {
-        stdout_.append(buffer, nread);
+    close(fds[1]);
+    tee.start();
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            perror_msg_and_die("Can't wait for child");
     }
-    lseek(stderr_fd, 0, SEEK_SET);
-    while (int nread = read(stderr_fd, buffer, sizeof(buffer))) {
-        stderr_.append(buffer, nread);
+
+    char buffer[65536];
+    std::string pending;
+    bool exited = false;
+    while (!exited) {
+        ssize_t nread = read(fds[0], buffer, sizeof(buffer));
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            perror_msg_and_die("Can't read from tracer");
+        }
+        if (nread == 0) {
+            // it has said why on stderr
+            close(fds[0]);
+            throw std::runtime_error("Tracer exited before '" + cmd[0] + "' did");
+        }
+        pending.append(buffer, nread);
+
+        size_t start = 0, end;
+        while ((end = pending.find('\0', start)) != std::string::npos) {
+            if (pending[start] == 'o') {
+                open_callback(pending.substr(start + 1, end - start - 1));
+            } else if (pending[start] == 'x') {
+                exit_status = atoi(pending.c_str() + start + 1);
+                exited = true;
+            }
+            start = end + 1;
+        }
+        pending.erase(0, start);
     }
-    return std::make_tuple(stdout_, stderr_, exit_status);
+    close(fds[0]);
+
+    auto output = tee.finish();
+    return std::make_tuple(std::move(output.first), std::move(output.second), exit_status);
 }
 
 }; // namespace cache_dash_h
@@ -0,0 +1,159 @@
+#include "tee.h"
+#include "error_prints.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace cache_dash_h {
+
+output_tee::output_tee() {
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            perror_msg_and_die("Can't create pipe");
+        read_fds_[i] = fds[0];
+        write_fds_[i] = fds[1];
+    }
+    if (pipe2(stop_fds_, O_CLOEXEC) < 0)
+        perror_msg_and_die("Can't create pipe");
+}
+
+output_tee::~output_tee() {
+    if (thread_.joinable())
+        finish();
+    close(stop_fds_[0]);
+    close(stop_fds_[1]);
+}
+
+void output_tee::redirect_child() {
+    // dup2 leaves the copies without FD_CLOEXEC; the originals close on exec
+    if (dup2(write_fds_[0], STDOUT_FILENO) < 0 || dup2(write_fds_[1], STDERR_FILENO) < 0)
+        perror_msg_and_die("Can't redirect output");
+}
+
+void output_tee::start() {
+    close(write_fds_[0]);
+    close(write_fds_[1]);
+    // only the read ends: the child's write ends are descriptions of their own
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(read_fds_[i], F_SETFL, fcntl(read_fds_[i], F_GETFL) | O_NONBLOCK) < 0)
+            perror_msg_and_die("Can't make output pipe non-blocking");
+    }
+    thread_ = std::thread(&output_tee::run, this);
+}
+
+void output_tee::close_pipes() {
+    for (int i = 0; i < 2; i++) {
+        close(read_fds_[i]);
+        close(write_fds_[i]);
+        close(stop_fds_[i]);
+        read_fds_[i] = write_fds_[i] = stop_fds_[i] = -1;
+    }
+}
+
+std::pair<std::string, std::string> output_tee::finish() {
+    if (thread_.joinable()) {
+        char stop = 0;
+        while (write(stop_fds_[1], &stop, 1) < 0 && errno == EINTR)
+            ;
+        thread_.join();
+    }
+    return std::make_pair(std::move(captured_[0]), std::move(captured_[1]));
+}
+
+// write all of it, or return false
+static bool forward(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Read up to *max* bytes from pipe *i*, capture them and pass them on.
+   Returns what read() did: 0 at EOF, and -1 with EAGAIN when it's empty.
+*/
+ssize_t output_tee::pass_on(int i, size_t max) {
+    const int out_fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char buffer[65536];
+    ssize_t n;
+    do {
+        n = read(read_fds_[i], buffer, std::min(max, sizeof(buffer)));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno != EAGAIN)
+        perror_msg_and_die("Can't read output pipe");
+    if (n > 0) {
+        captured_[i].append(buffer, n);
+        if (forwarding_[i])
+            forwarding_[i] = forward(out_fds[i], buffer, n);
+    }
+    return n;
+}
+
+void output_tee::run() {
+    // if whoever reads our output goes away (e.g. "| head"), stop passing
+    // it on but keep capturing, so the cache still gets the whole thing.
+    // SIGPIPE from write() goes to the writing thread, so blocking it here
+    // turns it into EPIPE without changing what the child inherits.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    struct pollfd pfds[3] = {
+        {read_fds_[0], POLLIN, 0}, {read_fds_[1], POLLIN, 0}, {stop_fds_[0], POLLIN, 0}};
+    int num_open = 2;
+
+    while (num_open > 0) {
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror_msg_and_die("Can't poll output pipes");
+        }
+        if (pfds[2].revents != 0) {
+            // the child is gone, so everything it wrote is in the pipes by
+            // now. take just that much: a background writer could keep us
+            // reading forever.
+            for (int i = 0; i < 2; i++) {
+                int pending = 0;
+                if (pfds[i].fd < 0 || ioctl(pfds[i].fd, FIONREAD, &pending) < 0)
+                    continue;
+                while (pending > 0) {
+                    ssize_t n = pass_on(i, pending);
+                    if (n <= 0)
+                        break;
+                    pending -= n;
+                }
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+            if (pass_on(i, SIZE_MAX) == 0) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                num_open--;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pfds[i].fd >= 0)
+            close(pfds[i].fd);
+    }
+}
+
+}; // namespace cache_dash_h
@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <thread>
+
+namespace cache_dash_h {
+
+/* Passes a child's stdout and stderr through to ours as they arrive, while
+   keeping a copy of each for the cache. The copying runs on a thread of its
+   own, so it carries on while the calling thread is busy tracing.
+
+   Create it before forking, call redirect_child() in the child and start()
+   in the parent (close_pipes() in any process in between), and finish()
+   once the child has been waited for.
+*/
+class output_tee {
+  public:
+    output_tee();
+    ~output_tee();
+
+    // make the write ends of the pipes the child's stdout and stderr
+    void redirect_child();
+
+    void start();
+
+    // close every end in a process that only forks the child
+    void close_pipes();
+
+    /* Take whatever is already in the pipes, stop the thread and return what
+       came through each. Descendants the child left running in the
+       background may still hold the write ends, so this doesn't wait for
+       EOF.
+    */
+    std::pair<std::string, std::string> finish();
+
+  private:
+    void run();
+    ssize_t pass_on(int i, size_t max);
+
+    int read_fds_[2];
+    int write_fds_[2];
+    // finish() writes to stop_fds_[1] to wake the thread up
+    int stop_fds_[2];
+    bool forwarding_[2] = {true, true};
+    std::string captured_[2];
+    std::thread thread_;
+};
+
+}; // namespace cache_dash_h
@@ -0,0 +1,83 @@
+#include "trace.h"
+#include "preload.h"
+#include "strace.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace cache_dash_h {
+
+static std::vector<std::string> load_stable_paths() {
+    char* stablepaths = getenv("CACHEDASHH_STABLEPATH");
+    if (stablepaths == NULL) {
+        return {
+            "/usr/", "/etc/",  "/lib/",      "/lib64/", "/dev/",  "/proc/",
+            "/sys/", "/boot/", "/nix/store", "/gdn/",   "/proj/",
+        };
+    } else {
+        std::vector<std::string> paths;
+        str::split(std::string(stablepaths), ":",
+                   [&](const std::string& p) { paths.push_back(p); });
+        return paths;
+    }
+}
+
+/* Directory trees whose files are checked as one dependency each, by
+   prefix like the stable paths (see dependency_hasher) */
+static std::vector<std::string> load_tree_paths() {
+    std::vector<std::string> paths;
+    char* trees = getenv("CACHEDASHH_TREES");
+    if (trees != NULL) {
+        str::split(std::string(trees), ":", [&](const std::string& p) {
+            if (!p.empty())
+                paths.push_back(p);
+        });
+    }
+    return paths;
+}
+
+std::tuple<std::string, std::string, int> trace_command(std::vector<std::string>& cmd,
+                                                        const std::string& tracer,
+                                                        hash_memo_t memo,
+                                                        bool verbose,
+                                                        std::vector<hashed_file>* deps) {
+    auto stable_paths = load_stable_paths();
+    auto ignore_file = [&](const std::string& path) {
+        for (auto const& p : stable_paths) {
+            if (str::startswith(path, p)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // files are hashed as they're reported, while the command carries on
+    dependency_hasher hasher(memo, load_tree_paths());
+    if (!ignore_file(cmd[0]))
+        hasher.add(cmd[0]);
+
+    auto record_open = [&](const std::string& path) {
+        if (ignore_file(path))
+            return;
+        if (verbose)
+            printf("%s: loaded file: %s\n", program_invocation_short_name, path.c_str());
+        hasher.add(path);
+    };
+
+    // the preload tracer can't see into static or setuid binaries
+    bool use_preload = false;
+    if (tracer == "preload") {
+        use_preload = preload_tracer_supported(cmd);
+        if (!use_preload && verbose) {
+            printf("%s: Can't preload into '%s', tracing with ptrace\n",
+                   program_invocation_short_name, cmd[0].c_str());
+        }
+    }
+    fflush(stdout);
+    auto out = use_preload ? exec_and_record_opened_files_preload(cmd, record_open)
+                           : exec_and_record_opened_files(cmd, record_open);
+    *deps = hasher.finish();
+    return out;
+}
+
+}; // namespace cache_dash_h
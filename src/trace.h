@@ -0,0 +1,24 @@
+#pragma once
+#include "hasher.h"
+#include "utils.h"
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace cache_dash_h {
+
+/* Run *cmd* under *tracer* ("ptrace", or "preload" where the shim can see
+   into the program), passing its output through to ours as it runs, and
+   hash every file it opens outside the stable paths (CACHEDASHH_STABLEPATH)
+   into *deps*, as dependency_hasher does with *memo* and CACHEDASHH_TREES.
+   Returns what it printed and its exit status, as Database::Insert takes
+   them. Throws std::runtime_error if it can't be traced.
+*/
+std::tuple<std::string, std::string, int> trace_command(std::vector<std::string>& cmd,
+                                                        const std::string& tracer,
+                                                        hash_memo_t memo,
+                                                        bool verbose,
+                                                        std::vector<hashed_file>* deps);
+
+}; // namespace cache_dash_h
@@ -1,22 +1,25 @@
 #include "utils.h"
 #include "SpookyV2.h"
 #include "error_prints.h"
+#include "help_flags.h"
 #include "unistd.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
-#include <inttypes.h>
 #include <iterator>
 #include <libgen.h>
+#undef basename // we only want dirname from libgen.h
 //#include <linux/limits.h>
 #include <sstream>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <time.h>
 
 namespace cache_dash_h {
-static const std::vector<std::vector<std::string>> HELP_FLAGS{
-    {"-h", "--help"}, {"-showparams", "--showparams"}, {"-hh", "--help-all"}};
-
 std::string str::replace(const std::string& s, const std::string& from, const std::string& to) {
     size_t start_pos = s.find(from);
     if (start_pos == std::string::npos)
@@ -83,6 +86,37 @@ std::string str::join(const std::vector<std::string>& vec, const char* delim) {
     return res.str();
 }
 
+/* Evaluate pred(0), ..., pred(n-1) on a pool of up to one thread per core
+   and return whether they were all true. Workers stop picking up new items
+   as soon as any of them comes back false, so for dependency checks a single
+   changed file ends the whole thing early. Small inputs are done inline.
+*/
+bool parallel_all_of(size_t n, std::function<bool(size_t)> pred) {
+    static const size_t MIN_ITEMS_PER_THREAD = 16;
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    size_t num_threads = std::min(cores, n / MIN_ITEMS_PER_THREAD);
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&]() {
+        while (!failed.load(std::memory_order_relaxed)) {
+            size_t i = next.fetch_add(1);
+            if (i >= n)
+                return;
+            if (!pred(i))
+                failed.store(true);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+    return !failed.load();
+}
+
 bool cmd_has_dash_h(const std::vector<std::string>& cmd) {
     bool have_dash_h = false;
     for (auto const& item : cmd) {
@@ -99,16 +133,69 @@ bool cmd_has_dash_h(const std::vector<std::string>& cmd) {
     return have_dash_h;
 }
 
-std::string hexdigest(SpookyHash& spooky) {
+// timestamps within this window of the current time can't be trusted
+static const int64_t RACY_FINGERPRINT_NS = 2000000000LL;
+
+static void fill_fingerprint(const struct stat& statbuf, file_fingerprint* fp) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    fp->dev = statbuf.st_dev;
+    fp->ino = statbuf.st_ino;
+    fp->size = statbuf.st_size;
+    fp->mtime_ns = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+    fp->ctime_ns = statbuf.st_ctim.tv_sec * 1000000000LL + statbuf.st_ctim.tv_nsec;
+    fp->valid = (now_ns - fp->mtime_ns > RACY_FINGERPRINT_NS) &&
+                (now_ns - fp->ctime_ns > RACY_FINGERPRINT_NS);
+}
+
+bool stat_fingerprint(const char* fn, file_fingerprint* fp) {
+    struct stat statbuf;
+    if (stat(fn, &statbuf) < 0) {
+        fp->valid = false;
+        return false;
+    }
+    fill_fingerprint(statbuf, fp);
+    return fp->valid;
+}
+
+digest_t digest(SpookyHash& spooky) {
     uint64_t hash1;
     uint64_t hash2;
     spooky.Final(&hash1, &hash2);
-    char buf[33];
-    sprintf(buf, "%016" PRIx64 "%016" PRIx64, hash1, hash2);
-    return std::string(buf, 32);
+    digest_t d;
+    for (int i = 0; i < 8; i++) {
+        d.bytes[i] = static_cast<unsigned char>(hash1 >> (56 - 8 * i));
+        d.bytes[8 + i] = static_cast<unsigned char>(hash2 >> (56 - 8 * i));
+    }
+    return d;
+}
+
+std::string digest_t::hex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(2 * sizeof(bytes), '0');
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        s[2 * i] = digits[bytes[i] >> 4];
+        s[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    return s;
 }
 
-std::string hash_command_line(int length, const std::vector<std::string>& cmd) {
+bool parse_hex_digest(const std::string& s, digest_t* d) {
+    if (s.size() != 2 * sizeof(d->bytes))
+        return false;
+    for (size_t i = 0; i < sizeof(d->bytes); i++) {
+        unsigned int byte;
+        if (!isxdigit(s[2 * i]) || !isxdigit(s[2 * i + 1]) ||
+            sscanf(s.c_str() + 2 * i, "%2x", &byte) != 1)
+            return false;
+        d->bytes[i] = static_cast<unsigned char>(byte);
+    }
+    return true;
+}
+
+digest_t hash_command_line(int length, const std::vector<std::string>& cmd) {
     SpookyHash spooky;
     spooky.Init(0, 0);
 
@@ -130,37 +217,54 @@ std::string hash_command_line(int length, const std::vector<std::string>& cmd) {
                 }
             }
             if (any_flaglist) {
-                spooky.Update(static_cast<const void*>(flaglist[0].data()), flaglist[0].size());
+                spooky.Update(static_cast<const void*>(flaglist[0]), strlen(flaglist[0]));
             }
         }
     }
 
-    return hexdigest(spooky);
+    return digest(spooky);
+}
+
+digest_t hash_bytes(const void* data, size_t len) {
+    SpookyHash spooky;
+    spooky.Init(0, 0);
+    spooky.Update(data, len);
+    return digest(spooky);
 }
 
-std::string hash_filename(const std::string& fn, bool allow_ENOENT) {
+digest_t hash_filename(const char* fn, bool allow_ENOENT, file_fingerprint* fp) {
     SpookyHash spooky;
     spooky.Init(0, 0);
-    spooky.Update(fn.c_str(), fn.size());
+    spooky.Update(fn, strlen(fn));
 
-    auto fd = open(fn.c_str(), O_RDONLY);
+    if (fp != nullptr)
+        fp->valid = false;
+
+    auto fd = open(fn, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         if (allow_ENOENT && errno == ENOENT)
-            return hexdigest(spooky);
+            return digest(spooky);
         if (errno == EPERM || errno == EACCES)
-            return hexdigest(spooky);
-        perror_msg_and_die("Can't open: '%s'", fn.c_str());
+            return digest(spooky);
+        // hashed in, so that e.g. an EIO only matches the same EIO
+        int err = errno;
+        spooky.Update(&err, sizeof(err));
+        return digest(spooky);
     }
 
     struct stat statbuf;
-    if (fstat(fd, &statbuf) < 0)
-        perror_msg_and_die("Can't stat: '%s'", fn.c_str());
+    if (fstat(fd, &statbuf) < 0) {
+        int err = errno;
+        spooky.Update(&err, sizeof(err));
+        close(fd);
+        return digest(spooky);
+    }
+    if (fp != nullptr)
+        fill_fingerprint(statbuf, fp);
     if (!S_ISREG(statbuf.st_mode)) {
-        if (close(fd) < 0) {
-            perror_msg_and_die("Can't close: '%s'", fn.c_str());
-        }
-        // fprintf(stderr, "%s: WARNING: not regular file: %s\n", program_invocation_short_name, fn.c_str());
-        return hexdigest(spooky);
+        close(fd);
+        // fprintf(stderr, "%s: WARNING: not regular file: %s\n", program_invocation_short_name, fn);
+        return digest(spooky);
     }
     auto file_size = statbuf.st_size;
 
@@ -168,23 +272,56 @@ std::string hash_filename(const std::string& fn, bool allow_ENOENT) {
     if (file_size > 0) {
         auto file_buffer = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
         if (file_buffer == MAP_FAILED) {
-            fprintf(stderr, "%s: WARNING mmap failed: %s\n", program_invocation_short_name, fn.c_str());
-            if (close(fd) < 0)
-                perror_msg_and_die("Can't close: '%s'", fn.c_str());
-            return hexdigest(spooky);
+            fprintf(stderr, "%s: WARNING mmap failed: %s\n", program_invocation_short_name, fn);
+            close(fd);
+            return digest(spooky);
         }
         spooky.Update(file_buffer, file_size);
-        if (munmap(file_buffer, file_size) < 0)
-            perror_msg_and_die("Can't unmap: '%s'", fn.c_str());
+        munmap(file_buffer, file_size);
     }
 
-    if (close(fd) < 0)
-        perror_msg_and_die("Can't close: '%s'", fn.c_str());
+    close(fd);
+    return digest(spooky);
+}
+
+digest_t
+hash_filename(const char* fn, bool allow_ENOENT, file_fingerprint* fp, const hash_memo_t& memo) {
+    file_fingerprint current;
+    digest_t hash;
+    if (memo && stat_fingerprint(fn, &current) && memo(fn, current, &hash)) {
+        if (fp != nullptr)
+            *fp = current;
+        return hash;
+    }
+    return hash_filename(fn, allow_ENOENT, fp);
+}
 
-    return hexdigest(spooky);
+bool tree_digest(const char* root, const char* members, size_t len, digest_t* result) {
+    SpookyHash spooky;
+    spooky.Init(0, 0);
+    spooky.Update(root, strlen(root) + 1);
+
+    bool settled = true;
+    char path[PATH_MAX];
+    for (const char* member = members; member < members + len;) {
+        size_t member_len = strlen(member);
+        file_fingerprint fp;
+        if (snprintf(path, sizeof(path), "%s%s", root, member) >= static_cast<int>(sizeof(path)) ||
+            !stat_fingerprint(path, &fp)) {
+            settled = false;
+        }
+        // a missing file hashes as all zeros, which no settled one can
+        int64_t fields[5] = {static_cast<int64_t>(fp.dev), static_cast<int64_t>(fp.ino), fp.size,
+                             fp.mtime_ns, fp.ctime_ns};
+        spooky.Update(member, member_len + 1);
+        spooky.Update(fields, sizeof(fields));
+        member += member_len + 1;
+    }
+    *result = digest(spooky);
+    return settled;
 }
 
-std::string find_in_path(const std::string& filename_) {
+std::string find_in_path(const std::string& filename_, bool allow_ENOENT) {
     struct stat statbuf;
     const char* filename = filename_.c_str();
     char pathname[PATH_MAX + 1];
@@ -192,6 +329,8 @@ std::string find_in_path(const std::string& filename_) {
     size_t filename_len = strlen(filename);
 
     if (filename_len > sizeof(pathname) - 1) {
+        if (allow_ENOENT)
+            return "";
         errno = ENAMETOOLONG;
         perror_msg_and_die("exec");
     }
@@ -234,12 +373,96 @@ std::string find_in_path(const std::string& filename_) {
             pathname[0] = '\0';
     }
     if (stat(pathname, &statbuf) < 0) {
+        if (allow_ENOENT)
+            return "";
         perror_msg_and_die("Can't stat '%s'", filename);
     }
 
     return std::string(pathname);
 }
 
+/* Write all *len* bytes of *data* to *fd*, retrying short writes */
+void write_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror_msg_and_die("Can't write output");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+void write_output(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && S_ISFIFO(statbuf.st_mode)) {
+        while (len > 0) {
+            struct iovec iov = {const_cast<char*>(p), len};
+            ssize_t n = vmsplice(fd, &iov, 1, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                break; // e.g. EINVAL from an old kernel; copy what's left
+            }
+            p += n;
+            len -= n;
+        }
+    }
+    write_all(fd, p, len);
+}
+
+int lock_key(const std::string& path, const digest_t& key, int timeout_s, bool* waited) {
+    *waited = false;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+
+    // any byte will do, as long as the same key always gets the same one
+    uint64_t offset = 0;
+    for (int i = 0; i < 8; i++)
+        offset = (offset << 8) | key.bytes[i];
+    struct flock fl = {};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = static_cast<off_t>(offset >> 17);
+    fl.l_len = 1;
+
+    if (fcntl(fd, F_OFD_SETLK, &fl) == 0)
+        return fd;
+    if (errno != EAGAIN && errno != EACCES) {
+        close(fd);
+        return -1;
+    }
+    *waited = true;
+
+    // poll rather than block in F_OFD_SETLKW: giving that a deadline takes
+    // a signal, and signal handlers and timers belong to the whole process
+    // (which may be a program using libcachedashh). The polls start 1ms
+    // apart and back off to 50ms, which is small next to tracing a command.
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_s;
+    long delay_ms = 1;
+    while (fcntl(fd, F_OFD_SETLK, &fl) < 0) {
+        int err = errno;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((err != EAGAIN && err != EACCES && err != EINTR) ||
+            now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            close(fd);
+            return -1;
+        }
+        struct timespec pause = {0, delay_ms * 1000000};
+        nanosleep(&pause, nullptr);
+        delay_ms = std::min(delay_ms * 2, 50L);
+    }
+    return fd;
+}
+
 std::string path::getcwd() {
     char temp[PATH_MAX];
     return (::getcwd(temp, sizeof(temp)) ? std::string(temp) : std::string(""));
@@ -250,10 +473,21 @@ std::string path::realpath(const std::string& path) {
     return (::realpath(path.c_str(), temp) ? std::string(temp) : std::string(""));
 }
 
+std::string path::readlink(const std::string& path) {
+    char temp[PATH_MAX];
+    ssize_t len = ::readlink(path.c_str(), temp, sizeof(temp));
+    return (len >= 0 ? std::string(temp, len) : std::string(""));
+}
+
 std::string path::dirname(const std::string& path) {
     std::vector<char> cstr(path.c_str(), path.c_str() + path.size() + 1);
     return ::dirname(&cstr[0]);
 }
 
+std::string path::basename(const std::string& path) {
+    auto slash = path.rfind('/');
+    return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
 bool path::isabs(const std::string& path) { return (path.size() > 0 && path[0] == '/'); }
 } // namespace cache_dash_h
\ No newline at end of file
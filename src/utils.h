@@ -1,11 +1,21 @@
 #pragma once
+#include <fcntl.h>
 #include <functional>
 #include <limits.h>
 #include <memory>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
+// open file description locks, which glibc only names from 2.20 on
+#ifndef F_OFD_GETLK
+#define F_OFD_GETLK 36
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
+
 namespace cache_dash_h {
 
 struct c_cmdline {
@@ -42,21 +52,115 @@ std::string join(const std::vector<std::string>& vec, const char* delim);
 
 } // namespace str
 
-bool cmd_has_dash_h(const std::vector<std::string>& cmd);
+/* A 128-bit SpookyHash. The two 64-bit halves are stored big-endian, so the
+   bytes read in the same order as the hex form.
+*/
+struct digest_t {
+    unsigned char bytes[16];
+
+    bool operator==(const digest_t& o) const { return memcmp(bytes, o.bytes, sizeof(bytes)) == 0; }
+    bool operator!=(const digest_t& o) const { return !(*this == o); }
+    std::string hex() const;
+};
 
-std::string hash_command_line(int length, const std::vector<std::string>& cmd);
+bool parse_hex_digest(const std::string& s, digest_t* digest);
+
+/* Cheap stand-in for a file's content: if none of these changed since the
+   file was hashed, we assume the content didn't either. Fingerprints taken
+   while the file's timestamps are too close to "now" are marked invalid,
+   since a write in the same timestamp tick wouldn't be visible in them.
+*/
+struct file_fingerprint {
+    bool valid{false};
+    uint64_t dev{0};
+    uint64_t ino{0};
+    int64_t size{0};
+    int64_t mtime_ns{0};
+    int64_t ctime_ns{0};
+
+    bool operator==(const file_fingerprint& o) const {
+        return valid && o.valid && dev == o.dev && ino == o.ino && size == o.size &&
+               mtime_ns == o.mtime_ns && ctime_ns == o.ctime_ns;
+    }
+    bool operator!=(const file_fingerprint& o) const { return !(*this == o); }
+};
 
-std::string hash_filename(const std::string& fn, bool allow_ENOENT);
+bool stat_fingerprint(const char* fn, file_fingerprint* fp);
+inline bool stat_fingerprint(const std::string& fn, file_fingerprint* fp) {
+    return stat_fingerprint(fn.c_str(), fp);
+}
 
-std::string find_in_path(const std::string& filename);
+bool parallel_all_of(size_t n, std::function<bool(size_t)> pred);
+
+bool cmd_has_dash_h(const std::vector<std::string>& cmd);
+
+digest_t hash_command_line(int length, const std::vector<std::string>& cmd);
+
+digest_t hash_bytes(const void* data, size_t len);
+
+/* Hash the path and content of the file *fn*, filling in its fingerprint
+   if *fp* is given. Never fails: a file we may not read hashes as its path
+   alone (as does a missing one, given *allow_ENOENT*), and any other error
+   as its path and errno, so it only matches the same failure.
+*/
+digest_t hash_filename(const char* fn, bool allow_ENOENT, file_fingerprint* fp = nullptr);
+inline digest_t
+hash_filename(const std::string& fn, bool allow_ENOENT, file_fingerprint* fp = nullptr) {
+    return hash_filename(fn.c_str(), allow_ENOENT, fp);
+}
+
+/* Looks up the hash of the file *fn*, as of fingerprint *fp*, in a store
+   of previously hashed files. Must be callable from any thread.
+*/
+typedef std::function<bool(const char* fn, const file_fingerprint& fp, digest_t* hash)>
+    hash_memo_t;
+
+/* hash_filename, but a file that *memo* knows by its current fingerprint
+   isn't read at all. Files modified too recently for their fingerprint to
+   be trusted (see file_fingerprint) are always read.
+*/
+digest_t
+hash_filename(const char* fn, bool allow_ENOENT, file_fingerprint* fp, const hash_memo_t& memo);
+
+/* Stands in for the content of many files under the directory *root* at
+   once: a digest of the stat fingerprints of *members*, paths relative to
+   *root*, each NUL-terminated, back to back. Returns false if any of them
+   is missing or was modified too recently for its fingerprint to be
+   trusted, in which case the digest can't be relied on later.
+*/
+bool tree_digest(const char* root, const char* members, size_t len, digest_t* digest);
+
+// the path execvp would run for *filename*; "" if there's none and *allow_ENOENT*
+std::string find_in_path(const std::string& filename, bool allow_ENOENT = false);
+
+/* Take an exclusive lock on the byte of the lock file *path* (created if
+   need be) that *key* maps to, waiting up to *timeout_s* seconds for whoever
+   holds it. The lock belongs to the returned fd and goes away when that's
+   closed, or the process dies. *waited* says whether someone else held it.
+   Returns -1 if the file can't be opened or locked, or the wait timed out.
+*/
+int lock_key(const std::string& path, const digest_t& key, int timeout_s, bool* waited);
+
+// write(2) all *len* bytes at *data* to *fd*, or die trying
+void write_all(int fd, const void* data, size_t len);
+
+/* Like write_all, but if fd is a pipe the pages are spliced into it with
+   vmsplice() rather than copied, so *data* must stay unmodified for as long
+   as the reader might still see it.
+*/
+void write_output(int fd, const void* data, size_t len);
 
 namespace path {
 std::string getcwd();
 
 std::string realpath(const std::string& path);
 
+std::string readlink(const std::string& path);
+
 std::string dirname(const std::string& path);
 
+std::string basename(const std::string& path);
+
 bool isabs(const std::string& path);
 
 }; // namespace path
@@ -0,0 +1,536 @@
+#include "watch.h"
+#include "database.h"
+#include "error_prints.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace cache_dash_h {
+
+static const uint64_t WATCH_MAGIC = 0x63646877617432ULL; // "cdhwat2"
+static const uint64_t WATCH_SLOTS = 1 << 16;
+
+/* How often an idle watcher stamps the table, and how old a stamp lookups
+   still trust: past that, the watcher's behind on its events (busy checking
+   entries, or stopped) and the lookups validate entries themselves.
+*/
+static const int HEARTBEAT_INTERVAL_MS = 100;
+static const int64_t HEARTBEAT_MAX_AGE_MS = 250;
+
+// how long to wait for a burst of changes to end before checking anyway
+static const int64_t MAX_BURST_MS = 500;
+static const int64_t RESCAN_INTERVAL_MS = 1000;
+
+// anything that could make a dependency's content (or existence) differ
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                   IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                   IN_MOVE_SELF;
+
+/* Filesystems where inotify only sees changes made through this machine's
+   own syscalls (network and FUSE filesystems), or none at all (/proc, /sys).
+   Entries with files on them are left to the lookups to validate.
+*/
+static bool inotify_sees_changes(const struct statfs& fs) {
+    switch (static_cast<unsigned long>(fs.f_type)) {
+    case NFS_SUPER_MAGIC:
+    case SMB_SUPER_MAGIC:
+    case SMB2_SUPER_MAGIC:
+    case CIFS_SUPER_MAGIC:
+    case AFS_SUPER_MAGIC:
+    case CEPH_SUPER_MAGIC:
+    case CODA_SUPER_MAGIC:
+    case V9FS_MAGIC:
+    case FUSE_SUPER_MAGIC:
+    case PROC_SUPER_MAGIC:
+    case SYSFS_MAGIC:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// as many as we follow from one dependency, like the kernel's MAXSYMLINKS
+static const int MAX_SYMLINKS = 40;
+
+static uint64_t slot_index(int64_t cmdline_id) {
+    uint64_t x = static_cast<uint64_t>(cmdline_id) * 0x9E3779B97F4A7C15ULL;
+    return x >> 32;
+}
+
+static int64_t monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+static struct flock whole_file_lock(short type) {
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    return fl;
+}
+
+watch_table::~watch_table() {
+    if (header_ != nullptr)
+        munmap(header_, size_);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool watch_table::map(int prot) {
+    size_ = sizeof(header) + WATCH_SLOTS * sizeof(slot);
+    void* p = mmap(nullptr, size_, prot, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+        return false;
+    header_ = static_cast<header*>(p);
+    slots_ = reinterpret_cast<slot*>(header_ + 1);
+    return true;
+}
+
+bool watch_table::open(const std::string& db_path) {
+    fd_ = ::open((db_path + ".watch").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+        return false;
+
+    // a table nobody holds the lock on is left over from a watcher that's
+    // gone, and may be out of date
+    struct flock fl = whole_file_lock(F_RDLCK);
+    struct stat statbuf;
+    if (fcntl(fd_, F_OFD_GETLK, &fl) < 0 || fl.l_type == F_UNLCK || fstat(fd_, &statbuf) < 0 ||
+        static_cast<size_t>(statbuf.st_size) != sizeof(header) + WATCH_SLOTS * sizeof(slot) ||
+        !map(PROT_READ) || header_->magic != WATCH_MAGIC || header_->num_slots != WATCH_SLOTS) {
+        if (header_ != nullptr)
+            munmap(header_, size_);
+        header_ = nullptr;
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+watch_table::slot* watch_table::find(int64_t cmdline_id) const {
+    uint64_t mask = WATCH_SLOTS - 1;
+    for (uint64_t i = slot_index(cmdline_id), n = 0; n < WATCH_SLOTS; i++, n++) {
+        slot* s = &slots_[i & mask];
+        int64_t id = s->cmdline_id.load(std::memory_order_acquire);
+        if (id == cmdline_id || id == 0)
+            return s;
+    }
+    return nullptr;
+}
+
+bool watch_table::is_clean(int64_t cmdline_id, int64_t ctime) const {
+    if (header_ == nullptr)
+        return false;
+    int64_t heartbeat = header_->heartbeat_ms.load(std::memory_order_acquire);
+    if (heartbeat == 0 || monotonic_ms() - heartbeat > HEARTBEAT_MAX_AGE_MS)
+        return false;
+    slot* s = find(cmdline_id);
+    if (s == nullptr || s->cmdline_id.load(std::memory_order_acquire) != cmdline_id)
+        return false;
+    // the watcher zeroes clean_since before it touches the rest of a slot
+    uint64_t before = s->clean_since.load(std::memory_order_acquire);
+    int64_t slot_ctime = s->ctime.load(std::memory_order_acquire);
+    uint64_t after = s->clean_since.load(std::memory_order_acquire);
+    return before != 0 && before == after && slot_ctime == ctime;
+}
+
+bool watch_table::create(const std::string& db_path) {
+    fd_ = ::open((db_path + ".watch").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd_ < 0)
+        perror_msg_and_die("Can't open '%s.watch'", db_path.c_str());
+    struct flock fl = whole_file_lock(F_WRLCK);
+    if (fcntl(fd_, F_OFD_SETLK, &fl) < 0) {
+        // EINVAL: a kernel without OFD locks (before 3.15)
+        if (errno != EAGAIN && errno != EACCES)
+            perror_msg_and_die("Can't lock '%s.watch'", db_path.c_str());
+        return false;
+    }
+    if (ftruncate(fd_, sizeof(header) + WATCH_SLOTS * sizeof(slot)) < 0 ||
+        !map(PROT_READ | PROT_WRITE)) {
+        perror_msg_and_die("Can't map '%s.watch'", db_path.c_str());
+    }
+    header_->magic = 0;
+    header_->heartbeat_ms.store(0, std::memory_order_release);
+    clear();
+    header_->num_slots = WATCH_SLOTS;
+    header_->magic = WATCH_MAGIC;
+    return true;
+}
+
+bool watch_table::publish(int64_t cmdline_id, int64_t ctime, uint64_t generation) {
+    slot* s = find(cmdline_id);
+    if (s == nullptr)
+        return false;
+    if (s->cmdline_id.load() == 0) {
+        // keep well clear of a full table, where lookups would get slow
+        if (used_ >= WATCH_SLOTS / 2)
+            return false;
+        used_++;
+    }
+    s->clean_since.store(0, std::memory_order_release);
+    s->ctime.store(ctime, std::memory_order_release);
+    s->cmdline_id.store(cmdline_id, std::memory_order_release);
+    s->clean_since.store(generation, std::memory_order_release);
+    return true;
+}
+
+void watch_table::heartbeat(int64_t now_ms) {
+    header_->heartbeat_ms.store(now_ms, std::memory_order_release);
+}
+
+void watch_table::retract(int64_t cmdline_id) {
+    slot* s = find(cmdline_id);
+    if (s != nullptr && s->cmdline_id.load() == cmdline_id)
+        s->clean_since.store(0, std::memory_order_release);
+}
+
+void watch_table::clear() {
+    for (uint64_t i = 0; i < WATCH_SLOTS; i++)
+        slots_[i].clean_since.store(0, std::memory_order_release);
+    for (uint64_t i = 0; i < WATCH_SLOTS; i++) {
+        slots_[i].cmdline_id.store(0, std::memory_order_release);
+        slots_[i].ctime.store(0, std::memory_order_release);
+    }
+    used_ = 0;
+}
+
+namespace {
+
+enum entry_state {
+    UNCHECKED, // new, or its dependencies changed since it was checked
+    CLEAN,     // valid when checked, and published
+    STALE,     // invalid when checked; checked again if its files change
+    UNWATCHABLE,
+};
+
+struct watched_entry {
+    int64_t ctime;
+    entry_state state;
+};
+
+class watcher {
+  public:
+    watcher(Database& db, bool verbose) : db_(db), verbose_(verbose) {}
+
+    void run(const std::string& db_path) {
+        if (!table_.create(db_path))
+            error_msg_and_die("'%s' is already being watched", db_path.c_str());
+        inotify_fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (inotify_fd_ < 0)
+            perror_msg_and_die("Can't initialize inotify");
+        if (verbose_) {
+            printf("%s: Watching '%s'\n", program_invocation_short_name, db_path.c_str());
+            fflush(stdout);
+        }
+
+        while (1) {
+            try {
+                Rescan();
+            } catch (const SQLite::Exception& e) {
+                // most likely a writer held the lock too long: try again
+                if (verbose_)
+                    printf("%s: Can't read from cache: %s\n", program_invocation_short_name,
+                           e.what());
+            }
+            fflush(stdout);
+            Wait();
+        }
+    }
+
+  private:
+    /* Handle events until it's time to rescan: a second from now, or once a
+       burst of changes is over (an editor saving, a package being installed)
+       -- but no more than MAX_BURST_MS into one, so that a steady stream of
+       them can't hold off the checks for good.
+    */
+    void Wait() {
+        struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+        int64_t start = monotonic_ms(), burst_start = -1;
+        while (1) {
+            bool ready = poll(&pfd, 1, burst_start < 0 ? HEARTBEAT_INTERVAL_MS : 20) > 0;
+            ReadEvents();
+            int64_t now = monotonic_ms();
+            if (ready && burst_start < 0)
+                burst_start = now;
+            if (burst_start < 0 ? now - start >= RESCAN_INTERVAL_MS
+                                : !ready || now - burst_start >= MAX_BURST_MS)
+                return;
+        }
+    }
+
+    /* Pick up entries added to (or deleted from) the cache since last time,
+       and check every entry that's new or had a dependency change.
+    */
+    void Rescan() {
+        int64_t version = db_.db_.execAndGet("PRAGMA data_version").getInt64();
+        if (version != data_version_) {
+            data_version_ = version;
+            std::unordered_map<int64_t, int64_t> live;
+            SQLite::Statement q(db_.db_, "SELECT id, ctime FROM cmdline");
+            while (q.executeStep())
+                live[q.getColumn(0).getInt64()] = q.getColumn(1).getInt64();
+
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                auto l = live.find(it->first);
+                if (l == live.end() || l->second != it->second.ctime) {
+                    table_.retract(it->first);
+                    it = entries_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto const& l : live) {
+                if (entries_.count(l.first) == 0)
+                    entries_[l.first] = watched_entry{l.second, UNCHECKED};
+            }
+        }
+
+        generation_++;
+        for (auto& e : entries_) {
+            if (e.second.state == UNCHECKED) {
+                Check(e.first, &e.second);
+                // checking can take a while: don't let the queue overflow
+                ReadEvents();
+            }
+        }
+    }
+
+    /* Watch the dependencies of one entry, then validate it. A change that
+       lands after the watches are in place but before the check finishes
+       marks it unchecked again.
+    */
+    void Check(int64_t cmdline_id, watched_entry* entry) {
+        db_.LoadDependencies(cmdline_id, &set_);
+        bool watched = true;
+        for (size_t i = 0; i < set_.deps.size() && watched; i++) {
+            auto const& d = set_.deps[i];
+            if (d.members_size == 0) {
+                watched = Watch(set_.path(i), cmdline_id);
+                continue;
+            }
+            const char* members = set_.members(i);
+            for (size_t off = 0; off < d.members_size && watched;) {
+                const char* member = members + off;
+                watched = Watch(std::string(set_.path(i)) + member, cmdline_id);
+                off += strlen(member) + 1;
+            }
+        }
+        if (!watched) {
+            // e.g. out of inotify watches, a dependency's directory is gone,
+            // or it's somewhere we wouldn't hear about all its changes
+            entry->state = UNWATCHABLE;
+            if (verbose_)
+                printf("%s: Can't watch entry %lld\n", program_invocation_short_name,
+                       static_cast<long long>(cmdline_id));
+            return;
+        }
+
+        if (set_.deps.size() == 0 || !db_.ValidateDependencies(&set_)) {
+            entry->state = STALE;
+            return;
+        }
+        entry->state = CLEAN;
+        if (!table_.publish(cmdline_id, entry->ctime, generation_)) {
+            // full of deleted entries: start over with the live ones
+            table_.clear();
+            for (auto const& e : entries_) {
+                if (e.second.state == CLEAN)
+                    table_.publish(e.first, e.second.ctime, generation_);
+            }
+        }
+        if (verbose_)
+            printf("%s: Entry %lld is clean\n", program_invocation_short_name,
+                   static_cast<long long>(cmdline_id));
+    }
+
+    /* Watch the directory of the dependency *path*, and if it's a symlink,
+       whatever it points to as well.
+    */
+    bool Watch(const std::string& path, int64_t cmdline_id, int depth = 0) {
+        if (depth > MAX_SYMLINKS || !WatchDir(path::dirname(path), depth))
+            return false;
+        std::string target;
+        if (Readlink(path, &target) && !Watch(target, cmdline_id, depth + 1))
+            return false;
+        dependents_[path].insert(cmdline_id);
+        return true;
+    }
+
+    /* Watch *dir* and every directory above it, so that renaming or replacing
+       any of them is noticed as well. For a symlink, that's the symlink's
+       directory (where it could be retargeted) and then its target.
+    */
+    bool WatchDir(const std::string& dir, int depth) {
+        if (wds_.count(dir) != 0)
+            return true;
+        std::string parent = path::dirname(dir);
+        if (depth > MAX_SYMLINKS || (parent != dir && !WatchDir(parent, depth)))
+            return false;
+        std::string target;
+        if (Readlink(dir, &target) && !WatchDir(target, depth + 1))
+            return false;
+
+        struct statfs fs;
+        if (statfs(dir.c_str(), &fs) < 0 || !inotify_sees_changes(fs))
+            return false;
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+        if (wd < 0)
+            return false;
+        wds_[dir] = wd;
+        // two paths to the same directory share a watch descriptor
+        dirs_[wd].push_back(dir);
+        return true;
+    }
+
+    // if *path* is a symlink, set *target* to where it points
+    static bool Readlink(const std::string& path, std::string* target) {
+        struct stat statbuf;
+        if (lstat(path.c_str(), &statbuf) < 0 || !S_ISLNK(statbuf.st_mode))
+            return false;
+        *target = path::readlink(path);
+        if (target->empty())
+            return false;
+        if (!path::isabs(*target))
+            *target = path::dirname(path) + "/" + *target;
+        return true;
+    }
+
+    /* Stop watching *dir* and everything under it, after it moved or was
+       replaced: the watches follow the old directories, not the paths.
+       They're added again as the affected entries are checked.
+    */
+    void Unwatch(const std::string& dir) {
+        std::vector<std::pair<std::string, int>> gone;
+        for (auto const& w : wds_) {
+            if (w.first == dir || str::startswith(w.first, dir == "/" ? dir : dir + "/"))
+                gone.push_back(w);
+        }
+        for (auto const& w : gone) {
+            wds_.erase(w.first);
+            auto& paths = dirs_[w.second];
+            paths.erase(std::remove(paths.begin(), paths.end(), w.first), paths.end());
+            if (paths.empty()) {
+                inotify_rm_watch(inotify_fd_, w.second);
+                dirs_.erase(w.second);
+            }
+        }
+    }
+
+    void Invalidate(int64_t cmdline_id) {
+        auto it = entries_.find(cmdline_id);
+        if (it == entries_.end() || it->second.state == UNWATCHABLE)
+            return;
+        if (it->second.state == CLEAN)
+            table_.retract(cmdline_id);
+        it->second.state = UNCHECKED;
+    }
+
+    void InvalidateAll() {
+        for (auto& e : entries_) {
+            if (e.second.state == CLEAN)
+                table_.retract(e.first);
+            e.second.state = UNCHECKED;
+        }
+    }
+
+    // handle every queued event, then stamp the table
+    void ReadEvents() {
+        alignas(struct inotify_event) char buffer[65536];
+        // anything that changed before now is in the queue by now
+        int64_t now = monotonic_ms();
+        ssize_t n;
+        while ((n = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + n;) {
+                auto event = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                HandleEvent(event);
+            }
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            perror_msg_and_die("Can't read inotify events");
+        if (n < 0 && errno == EAGAIN)
+            table_.heartbeat(now);
+    }
+
+    void HandleEvent(const struct inotify_event* event) {
+        if (event->mask & IN_Q_OVERFLOW) {
+            InvalidateAll();
+            return;
+        }
+        auto it = dirs_.find(event->wd);
+        if (it == dirs_.end())
+            return;
+
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+            // rare enough not to bother working out which entries it affects
+            InvalidateAll();
+            if (event->mask & IN_MOVE_SELF) {
+                auto moved = it->second;
+                for (auto const& dir : moved)
+                    Unwatch(dir);
+            } else if (event->mask & IN_IGNORED) {
+                for (auto const& dir : it->second)
+                    wds_.erase(dir);
+                dirs_.erase(it);
+            }
+            return;
+        }
+        if (event->len == 0)
+            return;
+        const uint32_t replaced = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+        auto paths = it->second;
+        for (auto const& dir : paths) {
+            std::string path = (dir == "/" ? "" : dir) + "/" + event->name;
+            if ((event->mask & replaced) && wds_.count(path) != 0) {
+                // a directory on the way to some dependencies came or went
+                Unwatch(path);
+                InvalidateAll();
+                continue;
+            }
+            auto d = dependents_.find(path);
+            if (d == dependents_.end())
+                continue;
+            for (auto cmdline_id : d->second)
+                Invalidate(cmdline_id);
+        }
+    }
+
+    Database& db_;
+    bool verbose_;
+    watch_table table_;
+    int inotify_fd_{-1};
+    int64_t data_version_{-1};
+    uint64_t generation_{0};
+    dependency_set set_;
+    std::unordered_map<int64_t, watched_entry> entries_;
+    std::unordered_map<std::string, int> wds_;
+    std::unordered_map<int, std::vector<std::string>> dirs_;
+    std::unordered_map<std::string, std::unordered_set<int64_t>> dependents_;
+};
+
+} // namespace
+
+void run_watcher(Database& db, const std::string& db_path, bool verbose) {
+    watcher w(db, verbose);
+    w.run(db_path);
+}
+
+}; // namespace cache_dash_h
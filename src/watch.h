@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace cache_dash_h {
+
+struct Database;
+
+/* The table `cache-dash-h --watch` publishes next to the cache, in
+   CACHE.watch, and every lookup maps read-only: the ids of cached entries
+   none of whose dependencies changed since the watcher last checked them,
+   so a hit on one of them needn't touch its files at all.
+
+   An open-addressed hash table of fixed size, keyed by cmdline id. Only the
+   watcher writes to it, and it holds a lock on the file for as long as it
+   runs, so readers can tell a live table from one left behind. It also
+   stamps the table each time it has caught up with its inotify events, so
+   readers can tell one that's keeping up from one that's busy (or stuck)
+   and may not have retracted what changed.
+*/
+class watch_table {
+  public:
+    ~watch_table();
+
+    // map the table for the cache at *db_path*, if its watcher is running
+    bool open(const std::string& db_path);
+
+    /* Whether the entry *cmdline_id*, created at *ctime* (ids can be reused
+       once an entry is deleted), is known to be unchanged.
+    */
+    bool is_clean(int64_t cmdline_id, int64_t ctime) const;
+
+    // the watcher's side. create() fails if another watcher has the table.
+    bool create(const std::string& db_path);
+    bool publish(int64_t cmdline_id, int64_t ctime, uint64_t generation);
+    // everything that changed before *now_ms* (CLOCK_MONOTONIC) is retracted
+    void heartbeat(int64_t now_ms);
+    void retract(int64_t cmdline_id);
+    void clear();
+
+  private:
+    struct slot {
+        std::atomic<int64_t> cmdline_id;
+        std::atomic<int64_t> ctime;
+        std::atomic<uint64_t> clean_since; // 0: not known to be clean
+    };
+    struct header {
+        uint64_t magic;
+        uint64_t num_slots;
+        std::atomic<int64_t> heartbeat_ms; // 0: not caught up yet
+    };
+
+    bool map(int prot);
+    slot* find(int64_t cmdline_id) const;
+
+    int fd_{-1};
+    header* header_{nullptr};
+    slot* slots_{nullptr};
+    size_t size_{0};
+    size_t used_{0};
+};
+
+/* `cache-dash-h --watch`: keep inotify watches on the directories of every
+   dependency of every entry in *db*, and publish in a watch_table the
+   entries that were valid when checked and haven't been touched since.
+   Runs until killed.
+*/
+void run_watcher(Database& db, const std::string& db_path, bool verbose);
+
+}; // namespace cache_dash_h
@@ -133,6 +133,448 @@ function test11 {
     rm -rf $tmpdir
 }
 
+# dependencies are validated by stat fingerprint, falling back to content
+function test12 {
+    setup
+    tmpdir=$(mktemp -d)
+    echo "echo usage: script" > $tmpdir/script.sh
+    # fingerprints of files modified within the last couple of seconds
+    # aren't trusted, so let the script age a little
+    sleep 3
+    $CMD -v bash $tmpdir/script.sh --help | grep "Saved to cache"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path = '$tmpdir/script.sh' and mtime_ns is not null")" == 1 ]
+    $CMD -v bash $tmpdir/script.sh --help | grep "Read from cache"
+
+    # a touch changes the fingerprint but not the content
+    touch $tmpdir/script.sh
+    $CMD -v bash $tmpdir/script.sh --help | grep "Read from cache"
+
+    # same size, different content
+    echo "echo USAGE: script" > $tmpdir/script.sh
+    $CMD -v bash $tmpdir/script.sh --help | grep "Saved to cache"
+    rm -rf $tmpdir
+}
+
+# files opened by subprocesses, relative to their own cwd, are dependencies
+function test13 {
+    setup
+    tmpdir=$(mktemp -d)
+    mkdir $tmpdir/sub
+    echo "usage: sub" > $tmpdir/sub/foo
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "Saved to cache"
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "Read from cache"
+    echo "usage: changed" > $tmpdir/sub/foo
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "usage: changed"
+    rm -rf $tmpdir
+}
+
+# the LD_PRELOAD tracer finds the same dependencies, including subprocesses
+function test14 {
+    setup
+    export CACHEDASHH_TRACER=preload
+    tmpdir=$(mktemp -d)
+    mkdir $tmpdir/sub
+    echo "usage: sub" > $tmpdir/sub/foo
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "loaded file: $tmpdir/sub/foo"
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "Read from cache"
+    echo "usage: changed" > $tmpdir/sub/foo
+    $CMD -v bash -c "(cd $tmpdir/sub && cat foo); true" --help | grep "usage: changed"
+    unset CACHEDASHH_TRACER
+    rm -rf $tmpdir
+}
+
+# a change to any one of many dependencies is noticed
+function test15 {
+    setup
+    tmpdir=$(mktemp -d)
+    for i in $(seq 1 200); do
+        echo "file $i" > $tmpdir/dep$i
+    done
+    $CMD -v bash -c "cat $tmpdir/dep* > /dev/null; echo usage" --help | grep "Saved to cache"
+    $CMD -v bash -c "cat $tmpdir/dep* > /dev/null; echo usage" --help | grep "Read from cache"
+    echo "changed" > $tmpdir/dep137
+    $CMD -v bash -c "cat $tmpdir/dep* > /dev/null; echo usage" --help | grep "Saved to cache"
+    rm -rf $tmpdir
+}
+
+# databases with the original schema are migrated to the current version
+function test16 {
+    setup
+    sqlite3 $CACHEDASHH_DB "
+        CREATE TABLE cmdline (id INTEGER PRIMARY KEY, argv TEXT NOT NULL, hash TEXT NOT NULL,
+            ctime INTEGER NOT NULL, atime INTEGER NOT NULL, stdout TEXT NOT NULL,
+            stderr TEXT NOT NULL, exit_status INTEGER NOT NULL);
+        CREATE TABLE file (id INTEGER PRIMARY KEY, path TEXT NOT NULL, hash TEXT NOT NULL UNIQUE);
+        CREATE TABLE cmdline_file (id INTEGER PRIMARY KEY, cmdline_id INTEGER, file_id INTEGER,
+            UNIQUE(cmdline_id, file_id));"
+    $CMD -v bash --help | grep "Saved to cache"
+    [ "$(sqlite3 $CACHEDASHH_DB 'pragma user_version')" == 7 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select typeof(hash) from cmdline")" == blob ]
+    sqlite3 $CACHEDASHH_DB .schema | grep "CREATE INDEX cmdline_hash"
+    $CMD -v bash --help | grep "Read from cache"
+}
+
+# output with NUL bytes, and too big for one pipe buffer, is replayed intact
+function test17 {
+    setup
+    cat > big.sh << EOF
+head -c 300000 /dev/zero | tr '\\0' x
+printf 'a\\0b\\n'
+EOF
+    bash big.sh > expected.out
+    $CMD bash big.sh --help | cmp - expected.out
+    $CMD -v bash big.sh --help | grep "Read from cache"
+    $CMD bash big.sh --help | cmp - expected.out
+    $CMD bash big.sh --help > actual.out
+    cmp actual.out expected.out
+    rm -f big.sh expected.out actual.out
+}
+
+# big outputs are stored compressed, unless CACHEDASHH_COMPRESS=0 (or the
+# build has no zlib)
+function test18 {
+    bash --help > expected.out
+    seq 500 | sed 's/.*/line & of a long help text/' >> expected.out
+    if [ "${CACHEDASHH_TEST_ZLIB:-1}" != 0 ]; then
+        setup
+        $CMD bash -c "cat expected.out" --help | cmp - expected.out
+        [ "$(sqlite3 $CACHEDASHH_DB "select codec from output join cmdline on output.id = stdout_id")" == 1 ]
+        $CMD -v bash -c "cat expected.out" --help | grep "Read from cache"
+        $CMD bash -c "cat expected.out" --help | cmp - expected.out
+    fi
+
+    setup
+    CACHEDASHH_COMPRESS=0 $CMD bash -c "cat expected.out" --help | cmp - expected.out
+    [ "$(sqlite3 $CACHEDASHH_DB "select codec from output join cmdline on output.id = stdout_id")" == 0 ]
+    $CMD bash -c "cat expected.out" --help | cmp - expected.out
+    rm -f expected.out
+}
+
+# identical outputs are stored once, and freed with the last entry using them
+function test19 {
+    setup
+    $CMD bash -c "echo same help" --help | grep "same help"
+    $CMD bash -c "echo  same help" --help | grep "same help"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline")" == 2 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select refcount from output where cast(data as text) = 'same help' || char(10)")" == 2 ]
+    sqlite3 $CACHEDASHH_DB "delete from cmdline where id = 1"
+    [ "$(sqlite3 $CACHEDASHH_DB "select refcount from output where cast(data as text) = 'same help' || char(10)")" == 1 ]
+    sqlite3 $CACHEDASHH_DB "delete from cmdline where id = 2"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from output")" == 0 ]
+}
+
+# least recently used entries are evicted past CACHEDASHH_MAX_ENTRIES
+function test20 {
+    setup
+    export CACHEDASHH_MAX_ENTRIES=2
+    $CMD bash -c "echo one" --help
+    $CMD bash -c "echo two" --help
+    sqlite3 $CACHEDASHH_DB "update cmdline set atime = atime - 10 where argv like '%two%'"
+    $CMD -v bash -c "echo three" --help | grep "Evicted 1 entries"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline where argv like '%two%'")" == 0 ]
+    $CMD -v bash -c "echo one" --help | grep "Read from cache"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline_file")" == \
+      "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline_file where cmdline_id in
+                                 (select id from cmdline)")" ]
+    unset CACHEDASHH_MAX_ENTRIES
+}
+
+# --gc drops entries whose dependencies changed, and what only they used
+function test21 {
+    setup
+    echo 'echo version 1' > gc.sh
+    $CMD bash gc.sh --help | grep "version 1"
+    echo 'echo version 2' > gc.sh
+    $CMD bash gc.sh --help | grep "version 2"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline")" == 2 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path like '%gc.sh'")" == 2 ]
+    $CMD -v --gc | grep "Deleted 1 entries"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline")" == 1 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path like '%gc.sh'")" == 1 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from output")" == 2 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "pragma freelist_count")" == 0 ]
+    $CMD -v bash gc.sh --help | grep "Read from cache"
+    rm -f gc.sh
+}
+
+# concurrent misses for the same command trace it only once
+function test22 {
+    setup
+    for i in 1 2 3 4; do
+        $CMD -v bash -c "sleep 1; echo slow help" --help > concurrent.$i &
+    done
+    wait
+    [ "$(grep -l "Saved to cache" concurrent.* | wc -l)" == 1 ]
+    [ "$(grep -l "Read from cache" concurrent.* | wc -l)" == 3 ]
+    [ "$(grep -l "slow help" concurrent.* | wc -l)" == 4 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from cmdline")" == 1 ]
+    rm -f concurrent.*
+}
+
+# on a miss, output is passed through as the command prints it
+function test23 {
+    setup
+    start=$(date +%s%N)
+    $CMD bash -c "echo first; sleep 2; echo second" --help | {
+        read line
+        echo $((($(date +%s%N) - start) / 1000000)) > first.ms
+        cat > /dev/null
+    }
+    [ "$(cat first.ms)" -lt 1500 ]
+    rm -f first.ms
+
+    # and a reader that goes away early doesn't stop it being cached
+    setup
+    $CMD bash -c "seq 100000" --help | head -1
+    $CMD -v bash -c "seq 100000" --help | grep "Read from cache"
+    [ "$($CMD bash -c "seq 100000" --help | wc -l)" == 100000 ]
+}
+
+# CACHEDASHH_BACKGROUND returns right away, and saves from another process
+function test24 {
+    setup
+    export CACHEDASHH_BACKGROUND=1
+    set +e
+    $CMD -v bash -c "echo background; exit 3" --help > background.out
+    result=$?
+    set -e
+    [ "$result" == 3 ]
+    grep "Saving to cache in the background" background.out
+    for i in $(seq 50); do
+        if $CMD -v bash -c "echo background; exit 3" --help | grep "Read from cache"; then
+            break
+        fi
+        sleep 0.1
+    done
+    $CMD -v bash -c "echo background; exit 3" --help | grep "Read from cache"
+    unset CACHEDASHH_BACKGROUND
+    rm -f background.out
+}
+
+# files are hashed while the command runs, each once: one read twice gets a
+# single row, and one deleted before it could be hashed doesn't stop the save
+function test25 {
+    setup
+    tmpdir=$(mktemp -d)
+    local tmpfile=$tmpdir/transient.txt
+    $CMD -v bash -c "echo transient > $tmpfile; cat $tmpfile $tmpfile; rm $tmpfile" --help \
+        | grep "Saved to cache"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path = '$tmpfile'")" == 1 ]
+    rm -rf $tmpdir
+}
+
+# a file another command already hashed isn't read again: its hash comes
+# from file_memo, as long as the fingerprint still matches
+function test26 {
+    setup
+    $CMD bash -c "echo first" --help | grep "first"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file_memo where path like '%/bash'")" == 1 ]
+    sqlite3 $CACHEDASHH_DB "update file_memo set hash = zeroblob(16) where path like '%/bash'"
+    $CMD bash -c "echo second" --help | grep "second"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path like '%/bash'")" == 2 ]
+}
+
+# files under CACHEDASHH_TREES are one dependency on their stat metadata
+function test27 {
+    setup
+    tmpdir=$(mktemp -d)
+    mkdir -p $tmpdir/tree/pkg
+    for i in $(seq 1 20); do
+        echo "module $i" > $tmpdir/tree/pkg/mod$i.py
+    done
+    # fingerprints of files changed within the last two seconds aren't trusted
+    sleep 3
+    export CACHEDASHH_TREES=$tmpdir/tree/
+    $CMD -v bash -c "cat $tmpdir/tree/pkg/* > /dev/null; echo tree" --help | grep "Saved to cache"
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path like '$tmpdir/%'")" == 1 ]
+    [ "$(sqlite3 $CACHEDASHH_DB "select length(members) from file where path = '$tmpdir/tree/'")" \
+      == "$(ls $tmpdir/tree/pkg | sed 's,^,pkg/,' | tr '\n' '\0' | wc -c)" ]
+    $CMD -v bash -c "cat $tmpdir/tree/pkg/* > /dev/null; echo tree" --help | grep "Read from cache"
+    # same content, new metadata
+    touch $tmpdir/tree/pkg/mod7.py
+    $CMD -v bash -c "cat $tmpdir/tree/pkg/* > /dev/null; echo tree" --help | grep "Saved to cache"
+    # too recent to be part of a tree digest, so hashed as files
+    [ "$(sqlite3 $CACHEDASHH_DB "select count(*) from file where path like '$tmpdir/tree/pkg/%'")" \
+      == 20 ]
+    unset CACHEDASHH_TREES
+    rm -rf $tmpdir
+}
+
+# with a watcher running, a hit on an entry it checked doesn't check files,
+# and a change to a dependency still makes it a miss
+function test28 {
+    setup
+    tmpdir=$(mktemp -d)
+    echo "original" > $tmpdir/dep.txt
+    $CMD bash -c "cat $tmpdir/dep.txt; echo watched" --help | grep "original"
+    $CMD -v --watch > watch.log &
+    local watcher=$!
+    for i in $(seq 1 50); do
+        grep -q "Entry 1 is clean" watch.log && break
+        sleep 0.1
+    done
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo watched" --help | grep "according to the watcher"
+    echo "changed" > $tmpdir/dep.txt
+    sleep 0.5
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo watched" --help > watched.out
+    grep "Saved to cache" watched.out
+    grep "changed" watched.out
+    kill $watcher
+    wait $watcher || true
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo watched" --help > watched.out
+    grep "Read from cache" watched.out
+    if grep "according to the watcher" watched.out; then false; fi
+    rm -rf $tmpdir watch.log watched.out
+}
+
+# hits whose dependencies all have trustworthy fingerprints are served from
+# the index, which follows changes to them and to the database
+function test29 {
+    setup
+    tmpdir=$(mktemp -d)
+    echo "original" > $tmpdir/dep.txt
+    sleep 3
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo indexed" --help | grep "Saved to cache"
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo indexed" --help | grep "through its index"
+    # evicted entries leave the index with them
+    CACHEDASHH_MAX_ENTRIES=1 $CMD -v bash -c "echo evicting" --help | grep "Evicted 1 entries"
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo indexed" --help | grep "Saved to cache"
+    echo "changed" > $tmpdir/dep.txt
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo indexed" --help > indexed.out
+    grep "Saved to cache" indexed.out
+    grep "changed" indexed.out
+    # a new cache at the same path doesn't see the old one's index
+    rm -f $CACHEDASHH_DB
+    $CMD -v bash -c "echo other" --help | grep "Saved to cache"
+    $CMD -v bash -c "cat $tmpdir/dep.txt; echo indexed" --help | grep "Saved to cache"
+    rm -rf $tmpdir indexed.out
+}
+
+# with CACHEDASHH_STALE_MAX_AGE, a recent entry whose dependencies changed is
+# served as it was while a re-run refreshes it in the background
+function test30 {
+    setup
+    tmpdir=$(mktemp -d)
+    echo "original" > $tmpdir/dep.txt
+    $CMD -v bash -c "cat $tmpdir/dep.txt" --help | grep "Saved to cache"
+    echo "changed" > $tmpdir/dep.txt
+    export CACHEDASHH_STALE_MAX_AGE=1h
+    $CMD -v bash -c "cat $tmpdir/dep.txt" --help > stale.out
+    grep "Serving a stale result" stale.out
+    grep "original" stale.out
+    # the refresh runs in the background
+    for i in $(seq 50); do
+        [ "$(sqlite3 $CACHEDASHH_DB 'select count(*) from cmdline')" = 2 ] && break
+        sleep 0.2
+    done
+    $CMD -v bash -c "cat $tmpdir/dep.txt" --help > stale.out
+    grep "changed" stale.out
+    if grep "Serving a stale result" stale.out; then false; fi
+    # too old to serve
+    echo "again" > $tmpdir/dep.txt
+    sqlite3 $CACHEDASHH_DB "update cmdline set ctime = ctime - 7200"
+    $CMD -v bash -c "cat $tmpdir/dep.txt" --help > stale.out
+    grep "Saved to cache" stale.out
+    grep "again" stale.out
+    unset CACHEDASHH_STALE_MAX_AGE
+    rm -rf $tmpdir stale.out
+}
+
+# hits log their access instead of writing to the database
+function test31 {
+    setup
+    rm -f $CACHEDASHH_DB.access
+    $CMD bash -c "echo accessed" --help | grep "accessed"
+    sqlite3 $CACHEDASHH_DB "update cmdline set atime = 0"
+    $CMD -v bash -c "echo accessed" --help | grep "Read from cache"
+    $CMD -v bash -c "echo accessed" --help | grep "Read from cache"
+    [ "$(sqlite3 $CACHEDASHH_DB "select atime from cmdline")" == 0 ]
+    [ "$(stat -c %s $CACHEDASHH_DB.access)" == 32 ]
+    $CMD --gc
+    [ "$(sqlite3 $CACHEDASHH_DB "select atime from cmdline")" -gt 0 ]
+    [ ! -e $CACHEDASHH_DB.access ]
+}
+
+# --serve answers lookups over a socket
+function test32 {
+    setup
+    rm -f $CACHEDASHH_DB.sock
+    $CMD -v bash -c "echo served" --help | grep "Saved to cache"
+    cache-dash-h -v --serve > serve.out &
+    server=$!
+    for i in $(seq 50); do
+        [ -S $CACHEDASHH_DB.sock ] && break
+        sleep 0.1
+    done
+    # with no index, the server is asked before the database
+    rm -f $CACHEDASHH_DB.index
+    $CMD -v bash -c "echo served" --help > served.out
+    grep "through its server" served.out
+    grep "^served" served.out
+    # misses are still traced and saved by the client
+    $CMD -v bash -c "echo unserved" --help | grep "Saved to cache"
+    # a new cache at the same path makes the server exit
+    rm -f $CACHEDASHH_DB
+    $CMD -v bash -c "echo served" --help | grep "Saved to cache"
+    rm -f $CACHEDASHH_DB.index
+    $CMD -v bash -c "echo served" --help | grep "Read from cache"
+    wait $server
+    grep "was replaced" serve.out
+    [ ! -e $CACHEDASHH_DB.sock ]
+    rm -f serve.out served.out
+}
+
+# a miss returns when the command does, not when what it left in the
+# background does, and that keeps running untraced
+function test33 {
+    for tracer in ptrace preload; do
+        setup
+        rm -f background.out
+        start=$(date +%s)
+        CACHEDASHH_TRACER=$tracer $CMD bash -c \
+            "echo usage; (sleep 3; cat /etc/hostname > background.out) &" --help | grep usage
+        [ $(($(date +%s) - start)) -lt 3 ]
+        sleep 4
+        [ -s background.out ]
+        rm -f background.out
+    done
+}
+
+# the watcher notices a directory above a dependency being replaced, and a
+# symlink to one being retargeted
+function test34 {
+    setup
+    tmpdir=$(mktemp -d)
+    mkdir -p $tmpdir/a/b
+    echo "original" > $tmpdir/a/b/dep.txt
+    echo "other" > $tmpdir/other.txt
+    ln -s a/b/dep.txt $tmpdir/link.txt
+    $CMD bash -c "cat $tmpdir/a/b/dep.txt; echo watched" --help | grep "original"
+    $CMD bash -c "cat $tmpdir/link.txt; echo linked" --help | grep "original"
+    $CMD -v --watch > watch.log &
+    local watcher=$!
+    for i in $(seq 1 50); do
+        grep -q "Entry 1 is clean" watch.log && grep -q "Entry 2 is clean" watch.log && break
+        sleep 0.1
+    done
+    $CMD -v bash -c "cat $tmpdir/link.txt; echo linked" --help | grep "according to the watcher"
+    ln -sfn other.txt $tmpdir/link.txt
+    $CMD -v bash -c "cat $tmpdir/a/b/dep.txt; echo watched" --help | grep "according to the watcher"
+    mv $tmpdir/a $tmpdir/old
+    mkdir -p $tmpdir/a/b
+    echo "replaced" > $tmpdir/a/b/dep.txt
+    sleep 0.5
+    $CMD -v bash -c "cat $tmpdir/a/b/dep.txt; echo watched" --help > watched.out
+    if grep "according to the watcher" watched.out; then false; fi
+    grep "replaced" watched.out
+    $CMD -v bash -c "cat $tmpdir/link.txt; echo linked" --help > watched.out
+    if grep "according to the watcher" watched.out; then false; fi
+    grep "other" watched.out
+    kill $watcher
+    wait $watcher || true
+    rm -rf $tmpdir watch.log watched.out
+}
+
 test1
 test2
 test3
@@ -144,3 +586,26 @@ test8
 test9
 test10
 test11
+test12
+test13
+test14
+test15
+test16
+test17
+test18
+test19
+test20
+test21
+test22
+test23
+test24
+test25
+test26
+test27
+test28
+test29
+test30
+test31
+test32
+test33
+test34
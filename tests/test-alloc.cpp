@@ -0,0 +1,80 @@
+/*
+ * Checks that looking up a cached entry doesn't allocate per dependency:
+ * the number of operator new calls made by Database::FindValidEntry must be
+ * the same for a command with 2048 dependencies as for one with 8192.
+ */
+#include "database.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static std::atomic<long> num_allocations{0};
+
+void* operator new(size_t size) {
+    num_allocations++;
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+using namespace cache_dash_h;
+
+static long count_lookup_allocations(const std::string& dir, size_t num_deps) {
+    std::vector<std::string> cmd = {"test-alloc", std::to_string(num_deps)};
+    dependency_hasher hasher;
+    for (size_t i = 0; i < num_deps; i++) {
+        std::string path = dir + "/dep-" + std::to_string(num_deps) + "-" + std::to_string(i);
+        FILE* f = fopen(path.c_str(), "w");
+        if (f == nullptr) {
+            perror(path.c_str());
+            exit(1);
+        }
+        fprintf(f, "%zu\n", i);
+        fclose(f);
+        hasher.add(path);
+    }
+
+    Database db(dir + "/db-" + std::to_string(num_deps) + ".sqlite", false);
+    auto cmdhash = hash_command_line(static_cast<int>(cmd.size()), cmd);
+    db.Insert(cmd, cmdhash, std::make_tuple("out", "err", 0), hasher.finish());
+
+    // the first lookup prepares the statements and grows the buffers
+    if (db.FindValidEntry(cmdhash) < 0) {
+        fprintf(stderr, "no valid entry for %zu dependencies\n", num_deps);
+        exit(1);
+    }
+    long before = num_allocations;
+    int64_t id = db.FindValidEntry(cmdhash);
+    long count = num_allocations - before;
+    if (id < 0) {
+        fprintf(stderr, "no valid entry for %zu dependencies\n", num_deps);
+        exit(1);
+    }
+    printf("%zu dependencies: %ld allocations\n", num_deps, count);
+    return count;
+}
+
+int main() {
+    char tmpl[] = "/tmp/cache-dash-h-test-alloc-XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = tmpl;
+
+    long small = count_lookup_allocations(dir, 2048);
+    long large = count_lookup_allocations(dir, 8192);
+
+    std::string rm = "rm -rf '" + dir + "'";
+    if (system(rm.c_str()) != 0)
+        return 1;
+    return small == large ? 0 : 1;
+}
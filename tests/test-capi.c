@@ -0,0 +1,78 @@
+/*
+ * Checks the C API in cachedashh.h, from C: a miss, a traced command found
+ * again by a lookup, an entry recorded by hand, a miss once one of its
+ * dependencies changes, and a dependency that can't be opened.
+ */
+#include "cachedashh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);              \
+            exit(1);                                                                               \
+        }                                                                                          \
+    } while (0)
+
+static void write_file(const char* path, const char* content) {
+    FILE* f = fopen(path, "w");
+    CHECK(f != NULL);
+    fputs(content, f);
+    fclose(f);
+}
+
+int main(void) {
+    char dir[] = "/tmp/cache-dash-h-test-capi-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char db_path[64], dep_path[64], script_path[64], loop_path[64];
+    snprintf(db_path, sizeof(db_path), "%s/capi.db", dir);
+    snprintf(dep_path, sizeof(dep_path), "%s/dep.txt", dir);
+    snprintf(script_path, sizeof(script_path), "%s/help.sh", dir);
+    snprintf(loop_path, sizeof(loop_path), "%s/loop", dir);
+    setenv("CACHEDASHH_STABLEPATH", "/dev:/sys", 1);
+
+    cachedashh* cache = cachedashh_open(db_path);
+    CHECK(cache != NULL);
+    cachedashh_output out;
+
+    write_file(script_path, "echo traced help; exit 2\n");
+    const char* traced[] = {"sh", script_path, "--help", NULL};
+    CHECK(cachedashh_lookup(cache, traced, -1, &out) == 0);
+    CHECK(cachedashh_trace_and_record(cache, traced, -1, &out) == 0);
+    CHECK(strcmp(out.stdout_data, "traced help\n") == 0 && out.exit_status == 2);
+    cachedashh_free_output(&out);
+    CHECK(cachedashh_lookup(cache, traced, -1, &out) == 1);
+    CHECK(strcmp(out.stdout_data, "traced help\n") == 0 && out.exit_status == 2);
+    CHECK(out.stderr_size == 0);
+    cachedashh_free_output(&out);
+
+    write_file(dep_path, "version 1\n");
+    const char* recorded[] = {"true", "--help", NULL};
+    const char* deps[] = {dep_path, NULL};
+    cachedashh_output given = {(char*)"usage: true\n", 12, (char*)"warning\n", 8, 3};
+    CHECK(cachedashh_record(cache, recorded, -1, &given, deps) == 0);
+    CHECK(cachedashh_lookup(cache, recorded, -1, &out) == 1);
+    CHECK(out.stdout_size == 12 && memcmp(out.stdout_data, "usage: true\n", 12) == 0);
+    CHECK(out.stderr_size == 8 && memcmp(out.stderr_data, "warning\n", 8) == 0);
+    CHECK(out.exit_status == 3);
+    cachedashh_free_output(&out);
+
+    write_file(dep_path, "version 2, longer\n");
+    CHECK(cachedashh_lookup(cache, recorded, -1, &out) == 0);
+
+    // opening it fails with ELOOP, which is an error, not a reason to exit
+    CHECK(symlink("loop", loop_path) == 0);
+    const char* looped[] = {loop_path, NULL};
+    CHECK(cachedashh_record(cache, recorded, -1, &given, looped) == 0);
+    CHECK(cachedashh_lookup(cache, recorded, -1, &out) == 1);
+    cachedashh_free_output(&out);
+    cachedashh_close(cache);
+
+    char rm[128];
+    snprintf(rm, sizeof(rm), "rm -rf '%s'", dir);
+    return system(rm) == 0 ? 0 : 1;
+}